@@ -164,9 +164,7 @@ public:
             // If height is not known, let's start from square image and adjust height on the flight
             height = width;
 
-        if (params.depth == 1)
-            throw std::runtime_error("unsupported color depth=1 by interleaved color image builder");
-        else if (params.depth == 8) {
+        if (params.depth == 1 || params.depth == 8) {
             QImage img(width, height, QImage::Format_RGB32);
             img.fill(Qt::white);
             m_imageHolder.modifier().setImage(std::move(img));
@@ -184,7 +182,40 @@ public:
     void feedDataImpl(std::span<const unsigned char> data) override {
         auto modifier = m_imageHolder.modifier();
 
-        if (m_scanParams.depth == 8) {
+        if (m_scanParams.depth == 1) {
+            // Samples are bits going like [R,G,B], [R,G,B], ..., a row is padded to a byte. As for
+            // a gray image, a set bit means no light
+            const auto width = modifier.width();
+            const auto endPos = roundUp(width * 3, 8);
+
+            while (! data.empty()) {
+                auto toProcessBytes = std::min(endPos - m_linePos, (int)data.size());
+                const auto firstPx = m_linePos * 8 / 3;
+                const auto endPx = std::min(roundUp((m_linePos + toProcessBytes) * 8, 3), width);
+                auto destPtr = reinterpret_cast<QRgb*>(
+                    modifier.scanLine(m_scanLine, firstPx, endPx - firstPx));
+
+                for (int i = 0; i < toProcessBytes; ++i) {
+                    for (int b = 0; b < 8; ++b) {
+                        const auto bit = (m_linePos + i) * 8 + b;
+                        if (bit / 3 >= width)
+                            break;
+                        auto& px = destPtr[bit / 3];
+                        const int val = (data[i] >> (7 - b)) & 1 ? 0 : 255;
+                        switch (bit % 3) {
+                        case 0: px = qRgb(val, 0, 0); break;
+                        case 1: px = qRgb(qRed(px), val, 0); break;
+                        case 2: px = qRgb(qRed(px), qGreen(px), val); break;
+                        }
+                    }
+                }
+                data = data.subspan(toProcessBytes);
+                if ((m_linePos += toProcessBytes) == endPos) {
+                    m_linePos = 0;
+                    ++m_scanLine;
+                }
+            }
+        } else if (m_scanParams.depth == 8) {
             // m_linePos points to a channel inside a pixel, like [R,G,B], [R,G,B], ...
             const auto endPos = modifier.width() * 3;
 
@@ -284,19 +315,25 @@ bool Capturer::event(QEvent* ev) {
 }
 
 template<typename F, typename ...Args>
-void Capturer::wrappedCall(F&& f, QString msg, Args&& ... args) {
+bool Capturer::wrappedCall(F&& f, QString msg, Args&& ... args) {
     try {
         std::forward<F>(f)(std::forward<Args>(args) ...);
+        return true;
     } catch (const std::exception& e) {
         emit finished(false, tr("%1:\n%2").arg(msg, QString::fromLocal8Bit(e.what())));
     } catch (...) {
         emit finished(false, tr("%1; no additional info").arg(msg));
     }
+    return false;
 }
 
 void Capturer::start(int lineCountHint) {
     m_isCancelRequested = false;
     m_lineCountHint = lineCountHint;
+    // One posted event per a burst of chunks is enough - all pending chunks are drained at once
+    m_scannerDevice.set_notify_policy({true, 0, {}});
+    // Three-pass scanners give the whole image as one interleaved RGB frame then
+    m_scannerDevice.set_frames_policy({true, true});
     startInner();
 }
 
@@ -343,11 +380,7 @@ void Capturer::processScanningParameters() {
         } else
             m_imageBuilder->newFrame(*scanParams);
 
-        auto prgs = m_imageBuilder->getProgress();
-        if (auto p = get_if<double>(&prgs))
-            emit progress(*p);
-        else
-            emit progress(get<int>(prgs));
+        emitProgress();
     } catch (...) {
         m_lastError = std::current_exception();
         m_lastErrorContext = tr("Can't accept new image frame: %1");
@@ -356,45 +389,68 @@ void Capturer::processScanningParameters() {
 }
 
 void Capturer::processImageData() {
-    std::vector<unsigned char> chunk;
-    wrappedCall(
-        [this, &chunk](){
-            chunk = m_scannerDevice.get_scanning_data();
+    m_pendingChunks.clear();
+    // The object can be destroyed by a receiver of the finished() signal if the call fails
+    if (! wrappedCall(
+        [this](){
+            m_scannerDevice.get_scanning_data(m_pendingChunks);
         },
         tr("Can't get another captured image data")
-    );
+    ))
+        return;
+
+    // Notifications are coalesced, so there can be any number of chunks here including zero. The
+    // end-of-stream chunk is always the last one.
+    const bool isEndOfStream = ! m_pendingChunks.empty() && m_pendingChunks.back().empty();
+    bool dataFed = false;
 
-    if (chunk.empty()) {
-        if (m_isCancelRequested) {
-            emit finished(false, tr("Operation cancelled"));
-        } else if (m_lastError) {
-            try {
-               std::rethrow_exception(m_lastError);
-            } catch (const std::exception& e) {
-                emit finished(false, m_lastErrorContext.arg(QString::fromLocal8Bit(e.what())));
-            } catch (...) {
-                emit finished(false, m_lastErrorContext.arg(tr("<no data>")));
+    if (! m_isCancelRequested && ! m_lastError) {
+        for (const auto& chunk : m_pendingChunks) {
+            if (! chunk.empty()) {
+                m_imageBuilder->feedData(chunk);
+                dataFed = true;
             }
-        } else {
-            if (m_isLastFrame) {
-                // The image can grow vertically during feed scanning data but at the end its height
-                // should be right amount of processed scanned lines.
-                m_imageHolder.modifier().setHeight(m_imageBuilder->getFinalHeight());
-                emit finished(true, {});
-            } else
-                startInner();
         }
-    } else if (! m_isCancelRequested && ! m_lastError) {
-        m_imageBuilder->feedData({chunk.begin(), chunk.end()});
+    }
 
-        auto prgs = m_imageBuilder->getProgress();
-        if (auto p = get_if<double>(&prgs))
-            emit progress(*p);
-        else
-            emit progress(get<int>(prgs));
+    // Let buffers go back to the device's pool as soon as possible
+    m_pendingChunks.clear();
+
+    if (dataFed)
+        emitProgress();
+
+    if (! isEndOfStream)
+        return;
+
+    if (m_isCancelRequested) {
+        emit finished(false, tr("Operation cancelled"));
+    } else if (m_lastError) {
+        try {
+           std::rethrow_exception(m_lastError);
+        } catch (const std::exception& e) {
+            emit finished(false, m_lastErrorContext.arg(QString::fromLocal8Bit(e.what())));
+        } catch (...) {
+            emit finished(false, m_lastErrorContext.arg(tr("<no data>")));
+        }
+    } else {
+        if (m_isLastFrame) {
+            // The image can grow vertically during feed scanning data but at the end its height
+            // should be right amount of processed scanned lines.
+            m_imageHolder.modifier().setHeight(m_imageBuilder->getFinalHeight());
+            emit finished(true, {});
+        } else
+            startInner();
     }
 }
 
+void Capturer::emitProgress() {
+    auto prgs = m_imageBuilder->getProgress();
+    if (auto p = get_if<double>(&prgs))
+        emit progress(*p);
+    else
+        emit progress(get<int>(prgs));
+}
+
 void Capturer::cancel() {
     m_isCancelRequested = true;
     m_scannerDevice.cancel_scanning(s_cancelScanningMode);
@@ -10,6 +10,7 @@
 
 #include <exception>
 #include <variant>
+#include <vector>
 
 /*!
  * \brief An abstract interface for image builders supporting various image formats
@@ -54,6 +55,7 @@ private:
     vg_sane::device& m_scannerDevice;
     IImageHolder& m_imageHolder;
     std::unique_ptr<IImageBuilder> m_imageBuilder;
+    std::vector<vg_sane::scan_chunk> m_pendingChunks;
     std::exception_ptr m_lastError;
     QString m_lastErrorContext;
     int m_lineCountHint;
@@ -61,14 +63,19 @@ private:
     bool m_isLastFrame;
     bool m_isCancelRequested;
 
+    /*!
+     * \brief calls the functor and emits finished() signal with an error if it throws
+     * \return false if the functor has thrown
+     */
     template<typename F, typename ...Args>
-    void wrappedCall(F&& f, QString msg, Args&& ... args);
+    bool wrappedCall(F&& f, QString msg, Args&& ... args);
 
     bool event(QEvent* ev) override;
 
     void startInner();
     void processScanningParameters();
     void processImageData();
+    void emitProgress();
 
 public slots:
     void start(int);
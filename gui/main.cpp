@@ -11,6 +11,7 @@
 
 #include <QtGlobal>
 #include <QtDebug>
+#include <QLoggingCategory>
 
 #include <exception>
 
@@ -48,6 +49,10 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // Debug messages aren't even built by the library unless Qt is going to show them
+    if (QLoggingCategory::defaultCategory()->isDebugEnabled())
+        saneLibWrapperPtr->set_log_level(vg_sane::LogLevel::Debug);
+
     saneLibWrapperPtr->set_logger_sink([](vg_sane::LogLevel sev, std::string_view msg) {
         switch (sev) {
         case vg_sane::LogLevel::Debug:
@@ -63,7 +68,7 @@ int main(int argc, char *argv[])
             qCritical() << std::string{msg}.c_str();
             break;
         }
-    });
+    }, true);
 
     MainWindow w{saneLibWrapperPtr};
     w.show();
@@ -85,6 +85,8 @@ MainWindow::MainWindow(vg_sane::lib::ptr_t saneLibWrapper, QWidget *parent)
 
     auto deviceListModel = new DeviceListModel(m_saneLibWrapperPtr, this);
     m_ui->comboBox_devices->setModel(deviceListModel);
+    Q_ASSERT(connect(deviceListModel, &DeviceListModel::updated, this, &MainWindow::deviceListUpdated));
+    Q_ASSERT(connect(deviceListModel, &DeviceListModel::error, this, &MainWindow::deviceListError));
 
     auto oldDelegate = m_ui->tableView_device_opts->itemDelegate();
     auto delgt = new OptionItemDelegate(this);
@@ -111,12 +113,14 @@ void MainWindow::on_btnReloadDevs_clicked() {
     try {
         model->update();
     } catch (const std::exception& e) {
-        QMessageBox::critical(this, this->windowTitle(),
-            tr("Unable to update a list of devices: %1").arg(QString::fromLocal8Bit(e.what())));
+        deviceListError(QString::fromLocal8Bit(e.what()));
     } catch (...) {
-        QMessageBox::critical(this, this->windowTitle(),
-            tr("Unable to update a list of devices, no additional info"));
+        deviceListError({});
     }
+}
+
+void MainWindow::deviceListUpdated() {
+    auto model = static_cast<DeviceListModel*>(m_ui->comboBox_devices->model());
 
     if (model->rowCount({}) == 0) {
         // zero-sized model should cause combobox's index to reset to -1 and corresponding [indexChanged]
@@ -128,6 +132,16 @@ void MainWindow::on_btnReloadDevs_clicked() {
     }
 }
 
+void MainWindow::deviceListError(QString msg) {
+    if (msg.isEmpty())
+        QMessageBox::critical(this, this->windowTitle(),
+            tr("Unable to update a list of devices, no additional info"));
+    else
+        QMessageBox::critical(this, this->windowTitle(),
+            tr("Unable to update a list of devices: %1").arg(msg));
+    deviceListUpdated();
+}
+
 void MainWindow::on_comboBox_devices_currentIndexChanged(int index) {
     if (index == -1) {
         m_ui->label_dev_model->clear();
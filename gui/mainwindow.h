@@ -36,6 +36,8 @@ public:
 private slots:
     void optionButtonPressed(const QModelIndex&);
     void optionModelError(QString);
+    void deviceListUpdated();
+    void deviceListError(QString);
     void scannedImageGot(bool, QString);
     void onDrawingImageScaleChanged(float);
     void onDrawingImageMoved(QPoint, QPoint);
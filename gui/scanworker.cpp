@@ -6,53 +6,104 @@
 #include <QBrush>
 #include <QtMath>
 
-#include <cstring>
 #include <algorithm>
 
 DeviceListModel::DeviceListModel(vg_sane::lib::ptr_t lib_ptr, QObject* parent)
     : QAbstractListModel(parent)
     , m_lib{std::move(lib_ptr)} {
+    // The listener is called from a background thread of the library. It's removed in the
+    // destructor before this object dies, and posted events are dropped by Qt together with it.
+    m_lib->set_device_list_listener([this](auto devices, auto err) {
+        QMetaObject::invokeMethod(this, [this, devices = std::move(devices), err]() {
+            applyDeviceList(std::move(devices), err);
+        }, Qt::QueuedConnection);
+    });
+    m_devices = m_lib->get_cached_device_infos();
+    for (auto info : m_devices->devices())
+        m_rows.push_back(makeRow(info));
+}
+
+DeviceListModel::~DeviceListModel() {
+    m_lib->set_device_list_listener();
 }
 
 void DeviceListModel::update() {
-    beginResetModel();
+    m_lib->refresh_device_infos();
+}
+
+DeviceListModel::Row DeviceListModel::makeRow(const vg_sane::device_info& info) {
+    return {QString::fromLocal8Bit(info.m_name.data(), info.m_name.size()),
+        QString::fromLocal8Bit(info.m_vendor.data(), info.m_vendor.size()),
+        QString::fromLocal8Bit(info.m_model.data(), info.m_model.size()),
+        QString::fromLocal8Bit(info.m_type.data(), info.m_type.size())};
+}
+
+void DeviceListModel::applyDeviceList(vg_sane::lib::device_list_ptr_t devices,
+                                      std::exception_ptr err) {
+    if (devices != m_devices) {
+        // Removing rows in descending order and then inserting in ascending one keeps indices
+        // of a diff valid during the whole process
+        const auto diff = vg_sane::device_list::diff(*m_devices, *devices);
+
+        for (auto it = diff.m_removed.rbegin(); it != diff.m_removed.rend(); ++it) {
+            beginRemoveRows({}, *it, *it);
+            m_rows.remove(*it);
+            endRemoveRows();
+        }
+        for (auto i : diff.m_added) {
+            beginInsertRows({}, i, i);
+            m_rows.insert(i, makeRow((*devices)[i]));
+            endInsertRows();
+        }
+        for (auto [_, i] : diff.m_changed) {
+            m_rows[i] = makeRow((*devices)[i]);
+            emit dataChanged(index(i), index(i));
+        }
+        m_devices = std::move(devices);
+    }
+
+    if (! err) {
+        emit updated();
+        return;
+    }
+
     try {
-        m_scannerInfos = m_lib->get_device_infos();
-    }  catch (...) {
-        m_scannerInfos = {};
-        endResetModel();
-        throw;
+        std::rethrow_exception(err);
+    } catch (const std::exception& e) {
+        emit error(QString::fromLocal8Bit(e.what()));
+    } catch (...) {
+        emit error({});
     }
-    endResetModel();
 }
 
 int DeviceListModel::rowCount(const QModelIndex &parent) const {
-    return parent == QModelIndex() ? m_scannerInfos.size() : 0;
+    return parent == QModelIndex() ? m_rows.size() : 0;
 }
 
 QVariant DeviceListModel::data(const QModelIndex &index, int role) const {
     if (index == QModelIndex() || index.parent() != QModelIndex() || index.column() != 0)
         return {};
 
-    const auto infoPtr = m_scannerInfos[index.row()];
+    const auto& row = m_rows[index.row()];
 
     switch (role)
     {
     case Qt::DisplayRole:
-        return QString::fromLocal8Bit(infoPtr->name);
+        return row.m_name;
     case DeviceTypeRole:
-        return QString::fromLocal8Bit(infoPtr->type);
+        return row.m_type;
     case DeviceModelRole:
-        return QString::fromLocal8Bit(infoPtr->model);
+        return row.m_model;
     case DeviceVendorRole:
-        return QString::fromLocal8Bit(infoPtr->vendor);
+        return row.m_vendor;
     default:
         return {};
     }
 }
 
 vg_sane::device DeviceListModel::openDevice(int index) const {
-    return m_lib->open_device(m_scannerInfos[index]->name);
+    // Rows and the snapshot can differ while the model is being updated
+    return m_lib->open_device(m_rows[index].m_name.toLocal8Bit().constData());
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -339,6 +390,7 @@ bool DeviceOptionModel::setData(const QModelIndex &index, const QVariant &value,
     bool res = false;
     vg_sane::device::set_opt_result_t opRes;
     const auto [optInd, descrPtr] = m_optionDescriptors[index.row()];
+    const auto generation = m_device.get_options_generation();
 
     try {
         switch (descrPtr->type) {
@@ -434,6 +486,12 @@ bool DeviceOptionModel::setData(const QModelIndex &index, const QVariant &value,
             endResetModel();
     }
     else if (res) {
+        // Setting one option can change others as a side effect
+        for (auto changedInd : m_device.changed_options_since(generation)) {
+            const auto row = changedInd - 1;
+            if (row != index.row())
+                emit dataChanged(this->index(row, ColumnValue), this->index(row, ColumnValue));
+        }
         emit dataChanged(index, index);
     }
 
@@ -441,61 +499,49 @@ bool DeviceOptionModel::setData(const QModelIndex &index, const QVariant &value,
 }
 
 QRect DeviceOptionModel::getScanAreaPx(double* dpiPtr) const {
-    double resolutionDpi = -1.0;
-    double tl_x, tl_y, br_x, br_y;
-    int axisUnit;
-    bool axisUnitSet = false;
-    int pointsFound = 0;
-
-    auto setOptTo = [this](const ::SANE_Option_Descriptor* descrPtr, auto optInd, auto& dest){
-        if (auto val = std::get<2>(m_device.get_option(optInd)); val.size() == 1) {
-            if (descrPtr->type == SANE_TYPE_INT)
-                dest = *val.begin();
-            else if (descrPtr->type == SANE_TYPE_FIXED)
-                dest = saneFixedToDouble(*val.begin());
-            else
-                return false;
-            return true;
+    using vg_sane::well_known_option;
+
+    // Returns a unit of the option or -1 if it's absent or isn't a single number
+    auto readOpt = [this](well_known_option opt, double& dest) -> int {
+        const auto optInd = m_device.find_option(opt);
+        if (! optInd)
+            return -1;
+
+        const auto descrPtr = m_optionDescriptors[*optInd - 1].second;
+        if (descrPtr->type != SANE_TYPE_INT && descrPtr->type != SANE_TYPE_FIXED)
+            return -1;
+
+        if (auto val = std::get<2>(m_device.get_option(*optInd)); val.size() == 1) {
+            dest = descrPtr->type == SANE_TYPE_INT ? *val.begin() : saneFixedToDouble(*val.begin());
+            return descrPtr->unit;
         }
-        return false;
+        return -1;
     };
 
-    for (const auto [optInd, descrPtr] : m_optionDescriptors) {
-        if (descrPtr->unit == SANE_UNIT_DPI && std::strcmp(descrPtr->name, "resolution") == 0) {
-            if (setOptTo(descrPtr, optInd, resolutionDpi) && dpiPtr)
-                *dpiPtr = resolutionDpi;
-            continue;
-        }
+    double resolutionDpi = -1.0;
+    if (readOpt(well_known_option::resolution, resolutionDpi) == SANE_UNIT_DPI) {
+        if (dpiPtr)
+            *dpiPtr = resolutionDpi;
+    } else
+        resolutionDpi = -1.0;
 
-        if (descrPtr->unit == SANE_UNIT_PIXEL || descrPtr->unit == SANE_UNIT_MM) {
-            int b = 1;
-            for (auto [name, dest] : {std::make_pair("tl-x", &tl_x), std::make_pair("tl-y", &tl_y),
-                        std::make_pair("br-x", &br_x), std::make_pair("br-y", &br_y)}) {
-                if (std::strcmp(descrPtr->name, name) == 0) {
-                    if (! axisUnitSet) {
-                        axisUnit = true;
-                        axisUnit = descrPtr->unit;
-                    }
-                    if (axisUnit != descrPtr->unit)
-                        continue;
-
-                    if (setOptTo(descrPtr, optInd, *dest))
-                        pointsFound |= b;
-                    break;
-                }
-                b <<= 1;
-            }
-        }
-    }
+    double tl_x, tl_y, br_x, br_y;
+    const int axisUnit = readOpt(well_known_option::tl_x, tl_x);
+    if (axisUnit != SANE_UNIT_PIXEL && axisUnit != SANE_UNIT_MM)
+        return {};
+
+    for (auto [opt, dest] : {std::make_pair(well_known_option::tl_y, &tl_y),
+            std::make_pair(well_known_option::br_x, &br_x),
+            std::make_pair(well_known_option::br_y, &br_y)})
+        if (readOpt(opt, *dest) != axisUnit)
+            return {};
 
     auto mmToPx = [resolutionDpi](auto val){ return val * resolutionDpi / 25.4; };
 
-    if (pointsFound == 0b1111) {
-        if (axisUnit == SANE_UNIT_PIXEL)
-            return QRect(tl_x, tl_y, br_x - tl_x, br_y - tl_y);
-        else if (resolutionDpi > 0.0)
-            return QRect(qFloor(mmToPx(tl_x)), qFloor(mmToPx(tl_y)),
-                qCeil(mmToPx(br_x - tl_x)), qCeil(mmToPx(br_y - tl_y)));
-    }
+    if (axisUnit == SANE_UNIT_PIXEL)
+        return QRect(tl_x, tl_y, br_x - tl_x, br_y - tl_y);
+    else if (resolutionDpi > 0.0)
+        return QRect(qFloor(mmToPx(tl_x)), qFloor(mmToPx(tl_y)),
+            qCeil(mmToPx(br_x - tl_x)), qCeil(mmToPx(br_y - tl_y)));
     return {};
 }
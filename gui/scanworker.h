@@ -27,6 +27,7 @@ public:
     };
 
     explicit DeviceListModel(vg_sane::lib::ptr_t lib_ptr, QObject* parent = nullptr);
+    ~DeviceListModel();
 
     int rowCount(const QModelIndex &parent) const override;
     QVariant data(const QModelIndex &index, int role) const override;
@@ -34,18 +35,35 @@ public:
     /**
      * @brief update a list of known devices
      *
-     * The model doesn't re-check devices connected to the box at background. This method should be
-     * called to do this.
+     * Enumeration of devices can take seconds, so it's done by the library at background and the
+     * model is updated later, when a new list is ready - only rows actually changed are inserted,
+     * removed or updated. Then either updated() or error() is emitted.
      */
     void update();
     vg_sane::device openDevice(int index) const;
 
 private:
+    struct Row {
+        QString m_name;
+        QString m_vendor;
+        QString m_model;
+        QString m_type;
+    };
+
     vg_sane::lib::ptr_t m_lib;
 
-    // This is a range of device infos actually stored in a SANE library's memory. The range
-    // is valid until the library is not unloaded and until new range is requested from it.
-    vg_sane::devices_t m_scannerInfos;
+    // The last applied snapshot, the model never touches device infos stored in a SANE library's
+    // memory. Rows are converted into Qt strings only once, when they appear or change.
+    vg_sane::lib::device_list_ptr_t m_devices;
+    QVector<Row> m_rows;
+
+    static Row makeRow(const vg_sane::device_info& info);
+
+    void applyDeviceList(vg_sane::lib::device_list_ptr_t devices, std::exception_ptr err);
+
+signals:
+    void updated();
+    void error(QString);
 };
 
 // Additional types and registrations used for communicating with ScanWorker object
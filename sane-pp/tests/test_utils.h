@@ -0,0 +1,31 @@
+// vi: textwidth=100
+#pragma once
+
+#include <iostream>
+#include <string>
+
+namespace vg_sane::tests {
+
+// Failed checks are counted, so a test reports everything broken at once
+inline int g_failures = 0;
+
+inline void check(bool cond, const std::string& what) {
+    if (! cond) {
+        std::cerr << "check failed: " << what << '\n';
+        ++g_failures;
+    }
+}
+
+template <typename F>
+void check_throws(F&& f, const std::string& what) {
+    try {
+        f();
+    } catch (const std::exception&) {
+        return;
+    }
+    check(false, what + " (no exception)");
+}
+
+inline int result() { return g_failures == 0 ? 0 : 1; }
+
+} // ns vg_sane::tests
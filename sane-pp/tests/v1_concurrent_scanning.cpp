@@ -0,0 +1,82 @@
+// Scans all stub devices at once from separate threads, each one a few times in a row. Should be run
+// with SANE_PP_STUB_NO_DELAYS environment variable set.
+
+#include "sane_wrapper.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+namespace {
+
+constexpr int s_scans_per_device = 5;
+
+std::mutex g_errors_mutex;
+std::vector<std::string> g_errors;
+
+void fail(const std::string& msg) {
+    std::lock_guard guard{g_errors_mutex};
+    g_errors.push_back(msg);
+}
+
+void scan_device(vg_sane::lib::ptr_t lib, std::string name) {
+    try {
+        auto dev = lib->open_device(name.c_str());
+
+        for (int i = 0; i < s_scans_per_device; ++i) {
+            dev.start_scanning();
+            const auto* params = dev.get_scanning_parameters();
+            if (! params) {
+                fail(name + ": no scanning parameters");
+                return;
+            }
+
+            std::vector<unsigned char> data;
+            for (auto chunk = dev.get_scanning_data(); ! chunk.empty();
+                    chunk = dev.get_scanning_data())
+                data.insert(data.end(), chunk.begin(), chunk.end());
+
+            const auto expected = static_cast<std::size_t>(params->bytes_per_line)
+                * static_cast<std::size_t>(params->lines);
+            if (data.size() != expected) {
+                std::ostringstream ss;
+                ss << name << ": scan #" << i << " gave " << data.size() << " bytes instead of "
+                   << expected;
+                fail(ss.str());
+            } else if (! std::equal(data.begin(), data.end(),
+                    std::begin(vg_sane::details::g_sample_image))) {
+                fail(name + ": scan #" + std::to_string(i) + " gave unexpected data");
+            }
+        }
+    } catch (const std::exception& e) {
+        fail(name + ": " + e.what());
+    }
+}
+
+} // ns anonymous
+
+int main() {
+    auto lib = vg_sane::lib::instance();
+
+    std::vector<std::string> names;
+    for (const auto* info : lib->get_device_infos())
+        names.emplace_back(info->name);
+    if (names.size() < 2) {
+        std::cerr << "at least two stub devices are expected\n";
+        return 1;
+    }
+
+    {
+        std::vector<std::jthread> threads;
+        for (const auto& name : names)
+            threads.emplace_back(scan_device, lib, name);
+    }
+
+    for (const auto& e : g_errors)
+        std::cerr << e << '\n';
+    return g_errors.empty() ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+// Owned device list snapshots: sorting, interning of strings, lookup and the diff of two lists.
+
+#include "sane_wrapper.h"
+#include "test_utils.h"
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+using namespace vg_sane;
+using vg_sane::tests::check;
+
+namespace {
+
+device_list make_list(std::vector<::SANE_Device> devices) {
+    std::vector<const ::SANE_Device*> ptrs;
+    for (const auto& d : devices)
+        ptrs.push_back(&d);
+    ptrs.push_back(nullptr);
+    // Strings are copied, so the source can go away right after
+    return {ptrs.data(), std::chrono::steady_clock::now()};
+}
+
+void check_snapshot() {
+    const auto list = make_list({
+        {"usb:2", "HP", "DeskJet", "multi-function peripheral"},
+        {"net:1", "Canon", nullptr, "flatbed scanner"},
+        {"usb:1", "HP", "LaserJet", "multi-function peripheral"}});
+
+    check(list.size() == 3, "all devices are copied");
+    check(list[0].m_name == "net:1" && list[1].m_name == "usb:1" && list[2].m_name == "usb:2",
+        "devices are sorted by name");
+    check(list[0].m_model.empty() && list[0].m_model.data()[0] == '\0',
+        "a null string becomes an empty null-terminated one");
+    check(list.interned_count() == 4, "vendors and types are stored once");
+    check(list.find("usb:1") == 1u, "a device is found by name");
+    check(! list.find("usb:3"), "an absent device isn't found");
+}
+
+void check_diff() {
+    const auto from = make_list({
+        {"a", "v1", "m1", "t"},
+        {"b", "v1", "m2", "t"},
+        {"c", "v2", "m3", "t"}});
+    const auto to = make_list({
+        {"b", "v3", "m2", "t"},
+        {"c", "v2", "m3", "t"},
+        {"d", "v2", "m4", "t"}});
+
+    const auto diff = device_list::diff(from, to);
+    check(diff.m_removed == std::vector<std::uint32_t>{0}, "a device gone is reported as removed");
+    check(diff.m_added == std::vector<std::uint32_t>{2}, "a new device is reported as added");
+    check(diff.m_changed == std::vector<std::pair<std::uint32_t, std::uint32_t>>{{1, 0}},
+        "a device with other attributes is reported as changed");
+
+    check(device_list::diff(from, from).empty(), "a list doesn't differ from itself");
+
+    const auto all_added = device_list::diff(device_list{}, to);
+    check(all_added.m_added.size() == 3 && all_added.m_removed.empty(),
+        "everything is added to an empty list");
+    const auto all_removed = device_list::diff(from, device_list{});
+    check(all_removed.m_removed.size() == 3 && all_removed.m_added.empty(),
+        "everything is removed from a list");
+}
+
+} // ns anonymous
+
+int main() {
+    check_snapshot();
+    check_diff();
+    return vg_sane::tests::result();
+}
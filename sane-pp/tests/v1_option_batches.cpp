@@ -0,0 +1,71 @@
+// Setting a few options at once by set_options(), including a batch where options are reloaded with
+// another layout in the middle.
+
+#include "sane_wrapper.h"
+#include "sane_wrapper_utils.h"
+#include "test_utils.h"
+
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace vg_sane;
+using vg_sane::tests::check;
+using vg_sane::tests::check_throws;
+
+namespace {
+
+void check_wrong_alternative() {
+    auto dev = lib::instance()->open_device("dev 1");
+    ::SANE_Word word = 1;
+
+    bool thrown = false;
+    try {
+        dev.set_option(*dev.find_option("n4"), std::ref(word));
+    } catch (const vg_sane::error&) {
+        thrown = true;
+    }
+    check(thrown, "a value of a wrong type is reported as a library error");
+}
+
+void check_relayout() {
+    auto dev = lib::instance()->open_device("dev 1");
+    const auto n3 = dev.get(dev.get_typed_option<std::span<const ::SANE_Word>>("n3"));
+    const std::vector<::SANE_Word> n3_before(n3.begin(), n3.end());
+
+    // "test" makes the stub drop its first option, so n2 moves one position back
+    std::string str = "test";
+    ::SANE_Word n2 = 2 << SANE_FIXED_SCALE_SHIFT;
+    std::vector<device::option_setting_t> batch = {{"n4", str.data()}, {"n2", std::span{&n2, 1}}};
+    const auto res = dev.set_options(batch);
+
+    check(res.m_flags.test(static_cast<std::size_t>(device::set_opt_result_flags::reload_opts)),
+        "a reload is reported for the batch");
+    check(! dev.find_option("n0"), "options are reloaded");
+    check(dev.get(dev.get_typed_option<fixed>("n2")) == fixed{2 << SANE_FIXED_SCALE_SHIFT},
+        "an option moved by a reload is set by its name");
+    const auto n3_after = dev.get(dev.get_typed_option<std::span<const ::SANE_Word>>("n3"));
+    check(std::vector<::SANE_Word>(n3_after.begin(), n3_after.end()) == n3_before,
+        "an option which took the old position isn't touched");
+}
+
+void check_gone_after_relayout() {
+    auto dev = lib::instance()->open_device("dev 1");
+
+    std::string str = "test";
+    ::SANE_Word n0 = 4;
+    std::vector<device::option_setting_t> batch = {{"n4", str.data()}, {"n0", std::span{&n0, 1}}};
+    check_throws([&] { dev.set_options(batch); }, "an option dropped by a reload fails the batch");
+    check(dev.get(dev.get_typed_option<std::string_view>("n4")) == "test",
+        "options set before the failure stay set");
+    check(! dev.find_option("n0"), "the snapshot follows the reload after the failure");
+}
+
+} // ns anonymous
+
+int main() {
+    check_wrong_alternative();
+    check_relayout();
+    check_gone_after_relayout();
+    return vg_sane::tests::result();
+}
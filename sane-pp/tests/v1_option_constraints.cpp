@@ -0,0 +1,125 @@
+// Values adjusted to option constraints before they are sent to a device: ranges with a step, word
+// and string lists, and options which can't be set. Also a batch where an option is activated by
+// another one from the same batch.
+
+#include "sane_wrapper.h"
+#include "test_utils.h"
+
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace vg_sane;
+using vg_sane::tests::check;
+using vg_sane::tests::check_throws;
+
+namespace {
+
+bool inexact(device::set_opt_result_t flags) {
+    return flags.test(static_cast<std::size_t>(device::set_opt_result_flags::value_inexact));
+}
+
+// The adjusted value is written back into the passed buffer and set into a device
+::SANE_Word set_word(device& dev, const char* name, ::SANE_Word val, bool& adjusted) {
+    adjusted = inexact(dev.set_option(*dev.find_option(name), std::span{&val, 1}));
+    check(dev.get(dev.get_typed_option<std::span<const ::SANE_Word>>(name))[0] == val,
+        std::string{name} + ": the adjusted value is set");
+    return val;
+}
+
+void check_range(device& dev) {
+    bool adjusted = false;
+
+    // -6..6000 with the step 2
+    check(set_word(dev, "n0", 100, adjusted) == 100 && ! adjusted, "a legal value isn't adjusted");
+    check(set_word(dev, "n0", 7000, adjusted) == 6000 && adjusted, "a value is clamped from above");
+    check(set_word(dev, "n0", -10, adjusted) == -6 && adjusted, "a value is clamped from below");
+    check(set_word(dev, "n0", 7, adjusted) == 8 && adjusted, "a value is snapped to the step");
+
+    // 0.0..10.0 with the step 0.5
+    check(set_word(dev, "n2", SANE_FIX(1.3), adjusted) == SANE_FIX(1.5) && adjusted,
+        "a fixed value is rounded up to the nearest step");
+    check(set_word(dev, "n2", SANE_FIX(1.2), adjusted) == SANE_FIX(1.0) && adjusted,
+        "a fixed value is rounded down to the nearest step");
+
+    // -10..10 for each word of an array
+    std::vector<::SANE_Word> val = {-20, 5, 20};
+    const auto flags = dev.set_option(*dev.find_option("n1"), std::span{val});
+    check(inexact(flags) && val[0] == -10 && val[1] == 5 && val[2] == 10,
+        "each word of an array is clamped");
+}
+
+void check_lists(device& dev) {
+    std::string mode = "color";
+    check(inexact(dev.set_option(*dev.find_option(SANE_NAME_SCAN_MODE), mode.data()))
+        && mode == "Color", "a string is matched to a list ignoring case");
+    std::string sepia = "Sepia";
+    check_throws([&] { dev.set_option(*dev.find_option(SANE_NAME_SCAN_MODE), sepia.data()); },
+        "a string missing in a list isn't set");
+
+    // The list is {16, 1, 8}
+    bool adjusted = false;
+    check(set_word(dev, SANE_NAME_BIT_DEPTH, 8, adjusted) == 8 && ! adjusted,
+        "a word from a list isn't adjusted");
+    check(set_word(dev, SANE_NAME_BIT_DEPTH, 13, adjusted) == 16 && adjusted,
+        "a word is snapped to the nearest one of a list");
+    check(set_word(dev, SANE_NAME_BIT_DEPTH, 5, adjusted) == 8 && adjusted,
+        "a word is snapped to the nearest one in the middle of a list");
+    check(set_word(dev, SANE_NAME_BIT_DEPTH, 100, adjusted) == 16 && adjusted,
+        "a word above a list is snapped to the greatest one");
+    check(set_word(dev, SANE_NAME_BIT_DEPTH, 0, adjusted) == 1 && adjusted,
+        "a word below a list is snapped to the least one");
+}
+
+void check_inactive() {
+    auto dev = lib::instance()->open_device("dev 1");
+    ::SANE_Word depth = 16;
+    const auto depth_pos = *dev.find_option(SANE_NAME_BIT_DEPTH);
+    check_throws([&] { dev.set_option(depth_pos, std::span{&depth, 1}); },
+        "an inactive option isn't set");
+
+    auto other = lib::instance()->open_device("dev 2");
+    ::SANE_Word resolution = 20;
+    const auto resolution_pos = *other.find_option("resolution");
+    check_throws([&] { other.set_option(resolution_pos, std::span{&resolution, 1}); },
+        "an option which isn't software settable isn't set");
+}
+
+void check_batch() {
+    auto dev = lib::instance()->open_device("dev 1");
+
+    // Depth is active only in the color mode, the order in the batch doesn't matter
+    ::SANE_Word depth = 13;
+    std::string mode = "Color";
+    std::vector<device::option_setting_t> batch = {
+        {SANE_NAME_BIT_DEPTH, std::span{&depth, 1}}, {SANE_NAME_SCAN_MODE, mode.data()}};
+    const auto res = dev.set_options(batch);
+
+    check(dev.get(dev.get_typed_option<::SANE_Word>(SANE_NAME_BIT_DEPTH)) == 16,
+        "an option activated by another one from the batch is set");
+    check(depth == 16, "the adjusted value is written back into the batch");
+    check(res.m_inexact == std::vector<int>{*dev.find_option(SANE_NAME_BIT_DEPTH)},
+        "an adjusted option is reported for the batch");
+    check(inexact(res.m_flags), "value_inexact is reported for the batch");
+
+    std::string gray = "Gray";
+    std::vector<device::option_setting_t> inactive = {
+        {SANE_NAME_SCAN_MODE, gray.data()}, {SANE_NAME_BIT_DEPTH, std::span{&depth, 1}}};
+    check_throws([&] { dev.set_options(inactive); },
+        "an option deactivated by another one from the batch isn't set");
+    check(dev.get(dev.get_typed_option<std::string_view>(SANE_NAME_SCAN_MODE)) == "Gray",
+        "options set before the inactive one stay set");
+}
+
+} // ns anonymous
+
+int main() {
+    {
+        auto dev = lib::instance()->open_device("dev 1");
+        check_range(dev);
+        check_lists(dev);
+    }
+    check_inactive();
+    check_batch();
+    return vg_sane::tests::result();
+}
@@ -0,0 +1,108 @@
+// Generations of option values: what changed_options_since() reports after setting options directly,
+// in place inside the snapshot, with side effects, after a failure and after a reload.
+
+#include "sane_wrapper.h"
+#include "test_utils.h"
+
+#include <algorithm>
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace vg_sane;
+using vg_sane::tests::check;
+using vg_sane::tests::check_throws;
+
+namespace {
+
+using words_t = std::vector<::SANE_Word>;
+
+words_t words_of(device& dev, int pos) {
+    const auto val = dev.get<std::span<const ::SANE_Word>>(pos);
+    return {val.begin(), val.end()};
+}
+
+void check_direct_set(device& dev) {
+    const auto n0 = dev.get_typed_option<::SANE_Word>("n0");
+    const auto generation = dev.get_options_generation();
+
+    dev.set(n0, 4);
+    check(dev.get(n0) == 4, "a set value is read from the snapshot");
+    check(dev.get_options_generation() > generation, "setting a new value bumps the generation");
+    check(dev.changed_options_since(generation) == std::vector<int>{n0.index()},
+        "only the set option is reported");
+
+    const auto same = dev.get_options_generation();
+    dev.set(n0, 4);
+    check(dev.get_options_generation() == same, "setting the same value doesn't bump it");
+    check(dev.changed_options_since(same).empty(), "nothing is reported for the same value");
+}
+
+void check_side_effect(device& dev) {
+    // The stub overwrites the last word of n1 on every set
+    const auto pos = *dev.find_option("n1");
+    const auto generation = dev.get_options_generation();
+
+    words_t val = {5, 6, 7};
+    dev.set_option(pos, std::span{val});
+    check(words_of(dev, pos) == words_t{5, 6, 2}, "a value changed by a device is read back");
+    check(dev.changed_options_since(generation) == std::vector<int>{pos},
+        "an option changed by a device is reported");
+}
+
+void check_in_place(device& dev) {
+    const auto pos = *dev.find_option("n3");
+    const auto generation = dev.get_options_generation();
+
+    auto val = dev.get_option(pos);
+    std::get<std::span<::SANE_Word>>(val)[0] = 3 << SANE_FIXED_SCALE_SHIFT;
+    dev.set_option(pos, val);
+    check(words_of(dev, pos)[0] == 3 << SANE_FIXED_SCALE_SHIFT, "a value set in place is kept");
+    check(dev.changed_options_since(generation) == std::vector<int>{pos},
+        "a value set in place is reported although the snapshot was already modified");
+}
+
+void check_failed_in_place(device& dev) {
+    // The stub rejects 10 as the first word of n1
+    const auto pos = *dev.find_option("n1");
+    const auto before = words_of(dev, pos);
+    const auto generation = dev.get_options_generation();
+
+    auto val = dev.get_option(pos);
+    std::get<std::span<::SANE_Word>>(val)[0] = 10;
+    check_throws([&] { dev.set_option(pos, val); }, "a rejected value throws");
+    check(words_of(dev, pos) == before, "a rejected in-place value is read back from a device");
+    check(dev.changed_options_since(generation).empty(), "a rejected value isn't reported");
+}
+
+void check_reload(device& dev) {
+    // "test" makes the stub drop its first option, so the layout changes
+    const auto count = std::ranges::distance(dev.get_option_infos());
+    const auto generation = dev.get_options_generation();
+
+    std::string val = "test";
+    const auto flags = dev.set_option(*dev.find_option("n4"), val.data());
+    check(flags.test(static_cast<std::size_t>(device::set_opt_result_flags::reload_opts)),
+        "a reload is reported");
+    check(std::ranges::distance(dev.get_option_infos()) == count - 1, "options are reloaded");
+    check(! dev.find_option("n0"), "a dropped option isn't found");
+
+    std::vector<int> all(static_cast<std::size_t>(count - 1));
+    std::ranges::generate(all, [i = 0]() mutable { return ++i; });
+    check(dev.changed_options_since(generation) == all,
+        "all options are reported after a reload with another layout");
+}
+
+} // ns anonymous
+
+int main() {
+    auto lib = lib::instance();
+    auto dev = lib->open_device("dev 1");
+
+    check_direct_set(dev);
+    check_side_effect(dev);
+    check_in_place(dev);
+    check_failed_in_place(dev);
+    check_reload(dev);
+    return vg_sane::tests::result();
+}
@@ -0,0 +1,100 @@
+// Option profiles: a round trip through save_profile() and apply_profile(), a profile applied in two
+// passes, broken profiles and a profile of another device model.
+
+#include "sane_wrapper.h"
+#include "test_utils.h"
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace vg_sane;
+using vg_sane::tests::check;
+using vg_sane::tests::check_throws;
+
+namespace {
+
+void set_word(device& dev, const char* name, ::SANE_Word val) {
+    dev.set_option(*dev.find_option(name), std::span{&val, 1});
+}
+
+void set_string(device& dev, const char* name, std::string val) {
+    dev.set_option(*dev.find_option(name), val.data());
+}
+
+// Depth becomes active only in the color mode, so it's set by the second pass
+std::vector<std::byte> make_profile(lib::ptr_t lib) {
+    auto dev = lib->open_device("dev 1");
+    set_word(dev, "n0", 100);
+    set_word(dev, "n2", 3 << SANE_FIXED_SCALE_SHIFT);
+    set_string(dev, "n4", "profiled");
+    set_string(dev, SANE_NAME_SCAN_MODE, "Color");
+    set_word(dev, SANE_NAME_BIT_DEPTH, 16);
+
+    auto profile = dev.save_profile();
+    check(dev.profile_matches(profile), "a device matches its own profile");
+
+    set_word(dev, "n0", 200);
+    check(! dev.profile_matches(profile), "a changed option breaks the match");
+    dev.apply_profile(profile);
+    check(dev.get(dev.get_typed_option<::SANE_Word>("n0")) == 100, "a profile restores a value");
+    check(dev.profile_matches(profile), "a device matches a profile after applying it");
+    return profile;
+}
+
+void check_two_passes(lib::ptr_t lib, std::span<const std::byte> profile) {
+    auto dev = lib->open_device("dev 1");
+    check(! dev.profile_matches(profile), "a fresh device doesn't match the profile");
+
+    const auto generation = dev.get_options_generation();
+    const auto res = dev.apply_profile(profile);
+    check(dev.get(dev.get_typed_option<std::string_view>(SANE_NAME_SCAN_MODE)) == "Color",
+        "an option from the first pass is set");
+    check(dev.get(dev.get_typed_option<::SANE_Word>(SANE_NAME_BIT_DEPTH)) == 16,
+        "an option activated by the first pass is set by the second one");
+    check(dev.get(dev.get_typed_option<std::string_view>("n4")) == "profiled",
+        "a string is restored");
+    check(dev.profile_matches(profile), "the profile matches after applying it");
+    check(res.m_generation == dev.get_options_generation() && res.m_generation > generation,
+        "the generation after both passes is reported");
+}
+
+void check_broken(lib::ptr_t lib, std::vector<std::byte> profile) {
+    auto dev = lib->open_device("dev 1");
+    const auto generation = dev.get_options_generation();
+
+    auto truncated = profile;
+    truncated.pop_back();
+    check_throws([&] { dev.apply_profile(truncated); }, "a truncated profile isn't applied");
+    check_throws([&] { dev.profile_matches(truncated); }, "a truncated profile isn't compared");
+
+    auto extended = profile;
+    extended.push_back(std::byte{0});
+    check_throws([&] { dev.apply_profile(extended); }, "a profile with a tail isn't applied");
+
+    auto bad_magic = profile;
+    bad_magic[0] ^= std::byte{0xff};
+    check_throws([&] { dev.apply_profile(bad_magic); }, "not a profile isn't applied");
+
+    check_throws([&] { dev.apply_profile({}); }, "an empty profile isn't applied");
+    check(dev.get_options_generation() == generation, "nothing is set from a broken profile");
+}
+
+void check_other_model(lib::ptr_t lib, std::span<const std::byte> profile) {
+    auto dev = lib->open_device("dev 2");
+    check(! dev.profile_matches(profile), "a profile of another model doesn't match");
+    check_throws([&] { dev.apply_profile(profile); }, "a profile of another model isn't applied");
+}
+
+} // ns anonymous
+
+int main() {
+    auto lib = lib::instance();
+    const auto profile = make_profile(lib);
+
+    check_two_passes(lib, profile);
+    check_broken(lib, profile);
+    check_other_model(lib, profile);
+    return vg_sane::tests::result();
+}
@@ -0,0 +1,42 @@
+// Typed option handles: reading and setting through them and finding their options again after
+// a reload with another layout.
+
+#include "sane_wrapper.h"
+#include "test_utils.h"
+
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace vg_sane;
+using vg_sane::tests::check;
+using vg_sane::tests::check_throws;
+
+int main() {
+    auto dev = lib::instance()->open_device("dev 1");
+
+    const auto n0 = dev.get_typed_option<::SANE_Word>("n0");
+    const auto n1 = dev.get_typed_option<std::span<const ::SANE_Word>>("n1");
+    const auto n2 = dev.get_typed_option<fixed>("n2");
+    check(n1.name() == "n1", "a handle keeps the name of its option");
+    check_throws([&] { dev.get_typed_option<fixed>("n0"); }, "a handle of another type isn't got");
+
+    const auto n1_before = dev.get(n1);
+    const std::vector<::SANE_Word> n1_words(n1_before.begin(), n1_before.end());
+
+    // "test" makes the stub drop its first option, so the rest move one position back
+    std::string str = "test";
+    dev.set_option(*dev.find_option("n4"), str.data());
+
+    const auto n1_after = dev.get(n1);
+    check(std::vector<::SANE_Word>(n1_after.begin(), n1_after.end()) == n1_words,
+        "a stale handle reads its own option, not the one at its old position");
+    check(dev.set(n2, fixed::from_double(3.0)).none(), "a stale handle sets its own option");
+    check(dev.get(dev.get_typed_option<fixed>("n2")) == fixed::from_double(3.0),
+        "a value set through a stale handle is read by a new one");
+    check_throws([&] { dev.get(n0); }, "reading through a handle of a dropped option throws");
+    check_throws([&] { dev.set(n0, 2); }, "setting through a handle of a dropped option throws");
+    check_throws([&] { dev.get(typed_option<fixed>{}); }, "an empty handle can't be read");
+
+    return vg_sane::tests::result();
+}
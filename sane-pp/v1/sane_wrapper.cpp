@@ -3,37 +3,622 @@
 #include "sane_wrapper_utils.h"
 
 #include <stdexcept>
+#include <algorithm>
+#include <optional>
+#include <cstring>
+
+#include <cerrno>
+#include <system_error>
 
 #include <unistd.h>
-#include <sys/select.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <signal.h>
 
+#ifndef SANE_PP_MIN_LOG_LEVEL
+#define SANE_PP_MIN_LOG_LEVEL 0
+#endif
+
 namespace vg_sane {
 
+namespace {
+
+// Chooses a size of the next sane_read() block basing on a policy and on how much data a scanner
+// has returned for the previous request
+class read_size_tuner {
+public:
+    read_size_tuner(const device::read_size_policy& policy, const ::SANE_Parameters& params)
+        : m_line_size{params.bytes_per_line > 0 ? static_cast<std::size_t>(params.bytes_per_line) : 1}
+        , m_max_bytes{std::max<std::size_t>(policy.m_max_bytes, 1)}
+        , m_min_lines{std::max<std::size_t>(policy.m_min_lines, 1)}
+        , m_max_lines{std::max(m_max_bytes / m_line_size, m_min_lines)}
+        , m_lines{std::clamp(policy.m_initial_bytes / m_line_size, m_min_lines, m_max_lines)} {
+    }
+
+    std::size_t block_size() const {
+        return std::min(m_lines * m_line_size, m_max_bytes);
+    }
+
+    void update(std::size_t was_read) {
+        const auto requested = block_size();
+        if (was_read >= requested)
+            m_lines = std::min(m_lines * 2, m_max_lines);
+        else if (was_read < requested / 4)
+            m_lines = std::max(m_lines / 2, m_min_lines);
+    }
+
+private:
+    std::size_t m_line_size;
+    std::size_t m_max_bytes;
+    std::size_t m_min_lines;
+    std::size_t m_max_lines;
+    std::size_t m_lines;
+};
+
+// Decides whether a consumer should be notified about a just pushed chunk according to a policy
+class notify_coalescer {
+public:
+    explicit notify_coalescer(const device::notify_policy& policy)
+        : m_policy{policy} {
+    }
+
+    bool chunk_pushed(std::size_t size, bool queue_was_empty) {
+        if (! m_policy.m_coalesce)
+            return true;
+
+        const bool use_window = m_policy.m_time_window.count() > 0;
+        if (queue_was_empty && ! m_armed) {
+            m_armed = true;
+            m_pending_bytes = 0;
+            if (use_window)
+                m_armed_at = std::chrono::steady_clock::now();
+        }
+        if (! m_armed)
+            return false;
+
+        m_pending_bytes += size;
+        const bool use_watermark = m_policy.m_bytes_watermark > 0;
+        if ((! use_watermark && ! use_window)
+            || (use_watermark && m_pending_bytes >= m_policy.m_bytes_watermark)
+            || (use_window && std::chrono::steady_clock::now() - m_armed_at >= m_policy.m_time_window)) {
+
+            m_armed = false;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    device::notify_policy m_policy;
+    bool m_armed = false;
+    std::size_t m_pending_bytes = 0;
+    std::chrono::steady_clock::time_point m_armed_at;
+};
+
+// Collects the first two planes of a three-pass image (separate RED, GREEN and BLUE frames) and
+// turns every row of the last plane into a complete RGB row as soon as it arrives. So only two
+// planes are kept in memory instead of three, and a consumer gets data of the last pass at once
+class frame_interleaver {
+public:
+    // Frames of other layouts are passed through as they are
+    static bool supports(const ::SANE_Parameters& params) {
+        switch (params.depth) {
+        case 1:
+            return params.pixels_per_line > 0
+                && params.bytes_per_line >= (params.pixels_per_line + 7) / 8;
+        case 8:
+            return params.bytes_per_line > 0;
+        case 16:
+            return params.bytes_per_line > 0 && params.bytes_per_line % 2 == 0;
+        default:
+            return false;
+        }
+    }
+
+    explicit frame_interleaver(const ::SANE_Parameters& params)
+        : m_params{params}
+        , m_sample_size{params.depth == 16 ? 2u : 1u}
+        // Bits of one RGB pixel go one after another for depth 1, rows are padded to a byte
+        , m_out_line_size{params.depth == 1
+            ? (static_cast<std::size_t>(params.pixels_per_line) * 3 + 7) / 8
+            : static_cast<std::size_t>(params.bytes_per_line) * 3} {
+
+        start_frame(params);
+    }
+
+    // Parameters of the resulting single RGB frame
+    ::SANE_Parameters interleaved_parameters() const {
+        auto res = m_params;
+        res.format = SANE_FRAME_RGB;
+        res.last_frame = SANE_TRUE;
+        res.bytes_per_line = static_cast<::SANE_Int>(m_out_line_size);
+        return res;
+    }
+
+    void start_frame(const ::SANE_Parameters& params) {
+        if (params.format != SANE_FRAME_RED && params.format != SANE_FRAME_GREEN
+            && params.format != SANE_FRAME_BLUE)
+            throw error("unexpected frame format " + std::to_string(params.format)
+                + " in a three-pass image");
+        if (params.bytes_per_line != m_params.bytes_per_line || params.depth != m_params.depth)
+            throw error("frames of a three-pass image have different layout");
+
+        m_channel = params.format - SANE_FRAME_RED;
+        if (m_seen_channels & (1u << m_channel))
+            throw error("a frame of a three-pass image is repeated");
+        m_seen_channels |= 1u << m_channel;
+
+        if (collecting() && params.lines > 0)
+            m_planes[m_channel].reserve(static_cast<std::size_t>(params.lines)
+                * static_cast<std::size_t>(params.bytes_per_line));
+    }
+
+    bool collecting() const { return m_seen_channels != 0b111; }
+
+    // Memory at the end of the current plane for the next read
+    std::span<unsigned char> plane_dest(std::size_t size) {
+        auto& plane = m_planes[m_channel];
+        m_plane_committed = plane.size();
+        plane.resize(m_plane_committed + size);
+        return {plane.data() + m_plane_committed, size};
+    }
+
+    void commit_plane(std::size_t size) {
+        m_planes[m_channel].resize(m_plane_committed + size);
+    }
+
+    // Size of complete RGB rows which the next portion of the last plane gives
+    std::size_t output_size(std::size_t size) const {
+        return (m_row_tail.size() + size) / line_size() * m_out_line_size;
+    }
+
+    // Writes output_size(data.size()) bytes into `out`
+    void interleave(std::span<const unsigned char> data, unsigned char* out) {
+        const auto line = line_size();
+
+        while (! data.empty()) {
+            std::span<const unsigned char> row;
+            if (m_row_tail.empty() && data.size() >= line) {
+                row = data.first(line);
+                data = data.subspan(line);
+            } else {
+                const auto n = std::min(line - m_row_tail.size(), data.size());
+                m_row_tail.insert(m_row_tail.end(), data.begin(), data.begin() + n);
+                data = data.subspan(n);
+                if (m_row_tail.size() < line)
+                    break;
+                row = m_row_tail;
+            }
+
+            out = interleave_row(row, out);
+            m_row_tail.clear();
+        }
+    }
+
+    void finish() const {
+        if (collecting() || ! m_row_tail.empty())
+            throw error("three-pass image has ended unexpectedly");
+    }
+
+private:
+    ::SANE_Parameters m_params;
+    std::size_t m_sample_size;
+    std::size_t m_out_line_size;
+    std::vector<unsigned char> m_planes[3];
+    std::vector<unsigned char> m_row_tail;
+    std::size_t m_plane_committed = 0;
+    std::size_t m_row = 0;
+    unsigned m_seen_channels = 0;
+    int m_channel = 0;
+
+    std::size_t line_size() const { return static_cast<std::size_t>(m_params.bytes_per_line); }
+
+    unsigned char* interleave_row(std::span<const unsigned char> row, unsigned char* out) {
+        const auto line = line_size();
+        const auto offset = m_row++ * line;
+        const unsigned char* src[3];
+
+        for (int c = 0; c < 3; ++c) {
+            if (c == m_channel)
+                src[c] = row.data();
+            else if (m_planes[c].size() < offset + line)
+                throw error("frames of a three-pass image have different number of lines");
+            else
+                src[c] = m_planes[c].data() + offset;
+        }
+
+        if (m_params.depth == 1) {
+            std::fill_n(out, m_out_line_size, 0);
+            std::size_t bit = 0;
+            for (std::size_t px = 0; px < static_cast<std::size_t>(m_params.pixels_per_line); ++px)
+                for (int c = 0; c < 3; ++c, ++bit)
+                    if ((src[c][px / 8] >> (7 - px % 8)) & 1)
+                        out[bit / 8] |= static_cast<unsigned char>(0x80u >> (bit % 8));
+            return out + m_out_line_size;
+        }
+
+        for (std::size_t pos = 0; pos < line; pos += m_sample_size)
+            for (int c = 0; c < 3; ++c)
+                out = std::copy_n(src[c] + pos, m_sample_size, out);
+        return out;
+    }
+};
+
+// Copies data into memory provided by a sink piece by piece
+void copy_into_sink(scan_sink& sink, std::span<const unsigned char> data) {
+    while (! data.empty()) {
+        auto dest = sink.acquire(data.size());
+        if (dest.empty())
+            throw error("scan sink refused to accept more data");
+
+        const auto n = std::min(dest.size(), data.size());
+        std::copy_n(data.data(), n, dest.data());
+        sink.commit(n);
+        data = data.subspan(n);
+    }
+}
+
+} // ns anonymous
+
+namespace details {
+
+chunk_queue::~chunk_queue() {
+    if (m_spill_fd >= 0)
+        ::close(m_spill_fd);
+}
+
+void chunk_queue::clear() {
+    scan_chunk t;
+    while (m_ring.try_pop(t));
+    m_overflow.clear();
+    m_overflow_size.store(0, std::memory_order_relaxed);
+    m_bytes_in_memory.store(0, std::memory_order_relaxed);
+
+    if (m_spill_fd >= 0) {
+        ::close(m_spill_fd);
+        m_spill_fd = -1;
+    }
+    m_spill_offset = 0;
+}
+
+void chunk_queue::spill(const scan_chunk& chunk) {
+    if (m_spill_fd < 0) {
+        m_spill_fd = m_spill_directory.empty()
+            ? ::memfd_create("sane-pp-spill", MFD_CLOEXEC)
+            : ::open(m_spill_directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (m_spill_fd < 0)
+            throw std::system_error(errno, std::generic_category(),
+                "unable to create a spill file for scanned data"
+                + (m_spill_directory.empty() ? std::string{} : " in \"" + m_spill_directory + '"'));
+    }
+
+    for (std::size_t written = 0; written < chunk.size(); ) {
+        auto r = ::pwrite(m_spill_fd, chunk.data() + written, chunk.size() - written,
+            static_cast<::off_t>(m_spill_offset + written));
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category(),
+                "unable to write scanned data into a spill file");
+        }
+        written += static_cast<std::size_t>(r);
+    }
+    m_spill_offset += chunk.size();
+}
+
+scan_chunk chunk_queue::read_spilled(const overflow_entry& entry) {
+    scan_chunk res{m_pool, entry.m_spilled_size};
+
+    for (std::size_t was_read = 0; was_read < entry.m_spilled_size; ) {
+        auto r = ::pread(m_spill_fd, res.writable_data() + was_read,
+            entry.m_spilled_size - was_read, static_cast<::off_t>(entry.m_offset + was_read));
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            throw std::system_error(r < 0 ? errno : EIO, std::generic_category(),
+                "unable to read scanned data back from a spill file");
+        }
+        was_read += static_cast<std::size_t>(r);
+    }
+    res.resize(entry.m_spilled_size);
+    res.set_frame(entry.m_frame);
+
+    // The data is never read twice, so give the space back. Failure just means the file is bigger
+    (void)::fallocate(m_spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        static_cast<::off_t>(entry.m_offset), static_cast<::off_t>(entry.m_spilled_size));
+
+    return res;
+}
+
+} // ns details
+
 lib::wptr_t lib::m_inst_wptr;
+std::mutex lib::m_inst_mutex;
 
 // Internal interface of the library for objects inside this domain
 struct lib::lib_internal final {
-    template <typename F>
-    void log(LogLevel level, F&& msgProducer) {
-        if (m_parent->m_logger_sink) {
-            if constexpr (std::is_invocable_v<F>)
-                m_parent->m_logger_sink(level, std::forward<F>(msgProducer)());
-            else
-                m_parent->m_logger_sink(level, msgProducer);
+    static constexpr auto s_min_log_level = static_cast<LogLevel>(SANE_PP_MIN_LOG_LEVEL);
+    static constexpr std::size_t s_async_queue_capacity = 512;
+
+    /**
+     * A message producer is called only if the message is going to be delivered somewhere, so
+     * building of a message costs nothing when logging is disabled. Levels below the compile-time
+     * minimum don't produce any code at all.
+     */
+    template <LogLevel level, typename F>
+    void log(F&& msgProducer) {
+        if constexpr (level >= s_min_log_level) {
+            if (level < m_parent->m_log_level.load(std::memory_order_relaxed))
+                return;
+
+            const auto logger = current_logger();
+            if (! logger)
+                return;
+
+            if (logger->m_asynchronous) {
+                if constexpr (std::is_invocable_v<F>)
+                    post(level, std::forward<F>(msgProducer)());
+                else
+                    post(level, msgProducer);
+            } else {
+                if constexpr (std::is_invocable_v<F>)
+                    logger->m_sink(level, std::forward<F>(msgProducer)());
+                else
+                    logger->m_sink(level, msgProducer);
+            }
         }
     }
 
+    void set_logger_sink(logger_sink_t cb, bool asynchronous);
+    void stop_async_logging();
+
+    std::unique_lock<std::mutex> lock_enumeration() { return std::unique_lock{m_enumeration_mutex}; }
+
+    std::shared_future<device_list_ptr_t> request_device_refresh(bool force);
+    void stop_device_refresh();
+
 private:
     friend lib;
 
+    // Fixed size for the queue to be preallocated, longer messages are truncated
+    struct log_record {
+        LogLevel m_level;
+        std::uint16_t m_size;
+        char m_text[256 - sizeof(std::uint16_t) * 2];
+    };
+
+    // Never changed once published, set_logger_sink() replaces the whole object. A message being
+    // logged keeps the one it has taken alive
+    struct logger_state {
+        logger_sink_t m_sink;
+        bool m_asynchronous;
+    };
+
     lib* m_parent;
 
+    std::mutex m_logger_mutex;
+    std::shared_ptr<const logger_state> m_logger;
+    // Serializes set_logger_sink() calls, guards m_async_logger
+    std::mutex m_logger_setup_mutex;
+
+    details::mpmc_ring<log_record> m_async_records{s_async_queue_capacity};
+    std::atomic<std::uint32_t> m_async_posted = 0;
+    std::atomic<std::size_t> m_async_dropped = 0;
+    std::jthread m_async_logger;
+
     lib_internal(lib* parent) : m_parent{parent} {}
+
+    // A message is dropped if the queue is full - a scanning thread never waits for a logger
+    void post(LogLevel level, std::string_view msg) {
+        log_record rec;
+        rec.m_level = level;
+        rec.m_size = static_cast<std::uint16_t>(std::min(msg.size(), sizeof(rec.m_text)));
+        std::copy_n(msg.data(), rec.m_size, rec.m_text);
+
+        if (! m_async_records.try_push(std::move(rec))) {
+            m_async_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_async_posted.fetch_add(1, std::memory_order_release);
+        m_async_posted.notify_one();
+    }
+
+    std::shared_ptr<const logger_state> current_logger() {
+        std::lock_guard guard{m_logger_mutex};
+        return m_logger;
+    }
+
+    void stop_async_logging_unlocked();
+    void async_logging_loop(std::stop_token stop_token, std::shared_ptr<const logger_state> logger);
+
+    // sane_get_devices() invalidates a list returned by a previous call, so it's never called
+    // simultaneously from a user's thread and from the refresh thread. Backends keep their device
+    // lists in globals which sane_open() and sane_close() use too, so those are serialized with
+    // enumeration as well
+    std::mutex m_enumeration_mutex;
+
+    std::mutex m_device_cache_mutex;
+    std::condition_variable_any m_device_cache_cv;
+    device_list_ptr_t m_device_list = std::make_shared<const device_list>();
+    device_cache_policy m_device_cache_policy;
+    // Valid while there is a request not picked up by the refresh thread yet
+    std::promise<device_list_ptr_t> m_refresh_promise;
+    std::shared_future<device_list_ptr_t> m_refresh_future;
+    bool m_refresh_in_progress = false;
+    std::jthread m_device_refresher;
+
+    // Held while a listener is called, so it can be replaced safely
+    std::mutex m_device_listener_mutex;
+    device_list_listener_t m_device_listener;
+
+    devices_t get_devices_unlocked();
+    device_list_ptr_t enumerate_devices();
+    void device_refresh_loop(std::stop_token stop_token);
 };
 
+void lib::lib_internal::set_logger_sink(logger_sink_t cb, bool asynchronous) {
+    std::lock_guard guard{m_logger_setup_mutex};
+
+    std::shared_ptr<const logger_state> logger;
+    if (cb)
+        logger = std::make_shared<const logger_state>(logger_state{std::move(cb), asynchronous});
+
+    // Messages posted before the switch are delivered by the previous thread, a message posted by
+    // a thread which has taken the previous state a moment ago is delivered by the next
+    // asynchronous sink if any
+    {
+        std::lock_guard logger_guard{m_logger_mutex};
+        m_logger = logger;
+    }
+    stop_async_logging_unlocked();
+    if (logger && asynchronous)
+        m_async_logger = std::jthread{[this, logger](std::stop_token stop_token) {
+            async_logging_loop(std::move(stop_token), logger); }};
+}
+
+void lib::lib_internal::stop_async_logging() {
+    std::lock_guard guard{m_logger_setup_mutex};
+    stop_async_logging_unlocked();
+}
+
+void lib::lib_internal::stop_async_logging_unlocked() {
+    if (! m_async_logger.joinable())
+        return;
+
+    m_async_logger.request_stop();
+    m_async_posted.fetch_add(1, std::memory_order_release);
+    m_async_posted.notify_one();
+    m_async_logger.join();
+    m_async_logger = {};
+}
+
+void lib::lib_internal::async_logging_loop(std::stop_token stop_token,
+                                           std::shared_ptr<const logger_state> logger) {
+    log_record rec;
+    bool run = true;
+
+    while (run) {
+        // Everything posted before the stop request is still delivered
+        run = ! stop_token.stop_requested();
+        const auto seen = m_async_posted.load(std::memory_order_acquire);
+
+        while (m_async_records.try_pop(rec))
+            logger->m_sink(rec.m_level, {rec.m_text, rec.m_size});
+
+        if (auto dropped = m_async_dropped.exchange(0, std::memory_order_relaxed); dropped != 0)
+            logger->m_sink(LogLevel::Warn,
+                std::to_string(dropped) + " log messages dropped because of logger overload");
+
+        if (run)
+            m_async_posted.wait(seen, std::memory_order_acquire);
+    }
+}
+
+std::shared_future<lib::device_list_ptr_t> lib::lib_internal::request_device_refresh(bool force) {
+    // Called under m_device_cache_mutex
+    if (m_refresh_future.valid() || (! force && m_refresh_in_progress))
+        return m_refresh_future;
+
+    m_refresh_promise = {};
+    m_refresh_future = m_refresh_promise.get_future().share();
+    if (! m_device_refresher.joinable())
+        m_device_refresher = std::jthread{[this](std::stop_token stop_token) {
+            device_refresh_loop(std::move(stop_token)); }};
+    m_device_cache_cv.notify_one();
+    return m_refresh_future;
+}
+
+void lib::lib_internal::stop_device_refresh() {
+    if (! m_device_refresher.joinable())
+        return;
+
+    m_device_refresher.request_stop();
+    m_device_refresher.join();
+    m_device_refresher = {};
+}
+
+devices_t lib::lib_internal::get_devices_unlocked() {
+    const ::SANE_Device** devices;
+#ifndef SANE_PP_STUB
+    details::checked_call("unable to get list of devices", ::sane_get_devices, &devices, SANE_TRUE);
+#else
+    static const SANE_Device device_descrs[] = {{"dev 1", "factory 1", "dev super rk1", "mfu"},
+        {"dev 2", "factory zzz", "not so super dev", "printer"}};
+    static const SANE_Device* device_descr_ptrs[] = {&device_descrs[0], &device_descrs[1], nullptr};
+    devices = device_descr_ptrs;
+#endif
+    // non-sized range could be returned instead (thus providing sentinel as an end iterator),
+    // but having size property drammatically simplifies user's code
+    auto d_end = devices;
+    for (; *d_end; ++d_end);
+    return std::ranges::subrange(devices, d_end);
+}
+
+lib::device_list_ptr_t lib::lib_internal::enumerate_devices() {
+    std::lock_guard guard{m_enumeration_mutex};
+    return std::make_shared<const device_list>(get_devices_unlocked().begin(),
+        std::chrono::steady_clock::now());
+}
+
+void lib::lib_internal::device_refresh_loop(std::stop_token stop_token) {
+    std::unique_lock lock{m_device_cache_mutex};
+
+    while (m_device_cache_cv.wait(lock, stop_token, [this]() { return m_refresh_future.valid(); })) {
+        // Requests coming from now on need one more enumeration, a device could be plugged in
+        // after this one has already started
+        auto promise = std::move(m_refresh_promise);
+        m_refresh_future = {};
+        m_refresh_in_progress = true;
+        lock.unlock();
+
+        device_list_ptr_t list;
+        std::exception_ptr err;
+        try {
+            list = enumerate_devices();
+        } catch (...) {
+            err = std::current_exception();
+        }
+
+        lock.lock();
+        if (list)
+            m_device_list = list;
+        else
+            list = m_device_list;
+        m_refresh_in_progress = false;
+        lock.unlock();
+
+        log<LogLevel::Debug>([&list, &err]() {
+            return err ? std::string{"device list refresh failed"}
+                : "device list refreshed, " + std::to_string(list->size()) + " devices";
+        });
+
+        {
+            std::lock_guard guard{m_device_listener_mutex};
+            if (m_device_listener) {
+                try {
+                    m_device_listener(list, err);
+                } catch (...) {
+                    log<LogLevel::Warn>("device list listener has thrown an exception");
+                }
+            }
+        }
+
+        // A waiter for the future sees the listener already notified
+        if (err)
+            promise.set_exception(err);
+        else
+            promise.set_value(list);
+
+        lock.lock();
+    }
+}
+
 lib::ptr_t lib::instance() {
+    std::lock_guard guard{m_inst_mutex};
     if (auto p = m_inst_wptr.lock())
         return p;
     auto p = ptr_t{new lib};
@@ -44,11 +629,13 @@ lib::ptr_t lib::instance() {
 #ifdef SANE_PP_CANCEL_VIA_SIGNAL_SUPPORT
 namespace {
 
-::SANE_Handle g_device_handle = {};
+// Every device has its own scanning worker thread and a cancel signal is sent exactly to that
+// thread, so the handle being read by it is found without any sharing between devices
+thread_local ::SANE_Handle t_device_handle = {};
 
 void cancel_sighandler(int sig, siginfo_t *info, void *ucontext) {
-    if (g_device_handle)
-        ::sane_cancel(g_device_handle);
+    if (t_device_handle)
+        ::sane_cancel(t_device_handle);
 }
 
 } // ns anonymous
@@ -71,246 +658,1089 @@ lib::lib()
 }
 
 lib::~lib() {
+    m_internal_iface->stop_device_refresh();
+    m_internal_iface->stop_async_logging();
 #ifndef SANE_PP_STUB
     ::sane_exit();
 #endif
 }
 
+void lib::set_logger_sink(logger_sink_t cb, bool asynchronous) {
+    m_internal_iface->set_logger_sink(std::move(cb), asynchronous);
+}
+
 devices_t lib::get_device_infos() const {
-    const ::SANE_Device** devices;
+    std::lock_guard guard{m_internal_iface->m_enumeration_mutex};
+    return m_internal_iface->get_devices_unlocked();
+}
+
+lib::device_list_ptr_t lib::get_cached_device_infos() {
+    std::lock_guard guard{m_internal_iface->m_device_cache_mutex};
+    const auto& list = m_internal_iface->m_device_list;
+
+    if (list->enumerated_at() == std::chrono::steady_clock::time_point{}
+        || std::chrono::steady_clock::now() - list->enumerated_at()
+            > m_internal_iface->m_device_cache_policy.m_ttl)
+        m_internal_iface->request_device_refresh(false);
+    return list;
+}
+
+std::shared_future<lib::device_list_ptr_t> lib::refresh_device_infos() {
+    std::lock_guard guard{m_internal_iface->m_device_cache_mutex};
+    return m_internal_iface->request_device_refresh(true);
+}
+
+void lib::set_device_cache_policy(device_cache_policy policy) {
+    std::lock_guard guard{m_internal_iface->m_device_cache_mutex};
+    m_internal_iface->m_device_cache_policy = policy;
+}
+
+lib::device_cache_policy lib::get_device_cache_policy() const {
+    std::lock_guard guard{m_internal_iface->m_device_cache_mutex};
+    return m_internal_iface->m_device_cache_policy;
+}
+
+void lib::set_device_list_listener(device_list_listener_t cb) {
+    std::lock_guard guard{m_internal_iface->m_device_listener_mutex};
+    m_internal_iface->m_device_listener = std::move(cb);
+}
+
+device lib::open_device(const char* name) {
+    device::handle_t h = {};
+    std::string sname = name;
+
+    // The name is reserved before opening, so concurrent calls can't open the same device twice
+    {
+        std::lock_guard guard{m_opened_device_names_mutex};
+        if (! m_opened_device_names.insert(sname).second)
+            throw error("already having device \"" + sname + "\" somewhere in the program");
+    }
+
+    try {
+#ifdef SANE_PP_STUB
+        if (std::strcmp(name, "dev 1") == 0) {
+            h = {std::make_shared<details::stub_option>("n0", "int sample", "", SANE_TYPE_INT, SANE_CAP_SOFT_SELECT, 1, SANE_UNIT_MM),
+                 std::make_shared<details::stub_option>("n1", "int list sample", "", SANE_TYPE_INT, SANE_CAP_SOFT_SELECT, 3, SANE_UNIT_BIT),
+                 std::make_shared<details::stub_option>("n2", "fixed sample", "", SANE_TYPE_FIXED, SANE_CAP_SOFT_SELECT),
+                 std::make_shared<details::stub_option>("n3", "fixed list sample", "", SANE_TYPE_FIXED, SANE_CAP_SOFT_SELECT, 3),
+                 std::make_shared<details::stub_option>("n4", "str", "", SANE_TYPE_STRING, SANE_CAP_SOFT_SELECT, 32),
+                 std::make_shared<details::stub_option>("n5", "btn", "", SANE_TYPE_BUTTON, SANE_CAP_SOFT_SELECT),
+                 std::make_shared<details::stub_option>(SANE_NAME_SCAN_MODE, "mode", "", SANE_TYPE_STRING, SANE_CAP_SOFT_SELECT, 16),
+                 std::make_shared<details::stub_option>(SANE_NAME_BIT_DEPTH, "depth", "", SANE_TYPE_INT, SANE_CAP_SOFT_SELECT | SANE_CAP_INACTIVE, 1, SANE_UNIT_BIT)};
+            h[0]->value<::SANE_Word>() = 2;
+            h[0]->set_int_range_constraint({-6, 6000, 2});
+            h[1]->values<::SANE_Word>() = {1, 2, 3};
+            h[1]->set_int_range_constraint({-10, 10, 1});
+            h[2]->value<::SANE_Fixed>() = 1 << SANE_FIXED_SCALE_SHIFT;
+            h[2]->set_int_range_constraint({0, 10 << SANE_FIXED_SCALE_SHIFT, 1 << (SANE_FIXED_SCALE_SHIFT - 1)});
+            h[3]->values<::SANE_Fixed>() = {1 << SANE_FIXED_SCALE_SHIFT, 2 << SANE_FIXED_SCALE_SHIFT, 5 << (SANE_FIXED_SCALE_SHIFT - 1)};
+            h[4]->str() = "test string";
+            h[6]->set_str_constraint({"Gray", "Color"}).str() = "Gray";
+            h[7]->set_int_list_constraint({16, 1, 8}).value<::SANE_Word>() = 8;
+        } else {
+            h = {std::make_shared<details::stub_option>("resolution", "resolution", "", SANE_TYPE_INT, 0, 1, SANE_UNIT_DPI)};
+            h[0]->value<::SANE_Word>() = 10;
+        }
+#else
+        std::lock_guard guard{m_internal_iface->m_enumeration_mutex};
+        details::checked_call([&name](){ return std::string{"unable to get device \""} + name + '"'; },
+            &::sane_open, name, &h);
+#endif
+    } catch (...) {
+        std::lock_guard guard{m_opened_device_names_mutex};
+        m_opened_device_names.erase(sname);
+        throw;
+    }
+
+    return {std::move(h), std::move(sname), m_internal_iface.get(),
+        [lib_ptr = m_inst_wptr.lock()](const std::string& name) {
+            std::lock_guard guard{lib_ptr->m_opened_device_names_mutex};
+            lib_ptr->m_opened_device_names.erase(name);
+        }};
+}
+
+//-----------------------------------------------------------------------------
+
+device::device(handle_t dev_handle, std::string name, lib::lib_internal* lib_int, deletion_cb_t deletion_cb)
+    : m_handle{std::move(dev_handle)}
+    , m_name{std::move(name)}
+    , m_lib_internal{lib_int}
+    , m_deletion_cb{std::move(deletion_cb)} {
+
+    m_lib_internal->log<LogLevel::Info>([this](){ return "opened device \"" + m_name + '"'; });
+}
+
+device::device(device&& r)
+    : m_handle{std::move(r.m_handle)}
+    , m_name{std::move(r.m_name)}
+    , m_lib_internal{r.m_lib_internal}
+    , m_deletion_cb{std::move(r.m_deletion_cb)}
+    , m_option_descriptors{std::move(r.m_option_descriptors)}
+    , m_option_names{std::move(r.m_option_names)}
+    , m_option_descriptors_valid{std::exchange(r.m_option_descriptors_valid, false)}
+    , m_option_layout_generation{r.m_option_layout_generation}
+    , m_option_index{std::move(r.m_option_index)}
+    , m_well_known_options{r.m_well_known_options}
+    , m_option_word_lists{std::move(r.m_option_word_lists)}
+    , m_sorted_word_lists{std::move(r.m_sorted_word_lists)}
+    , m_option_values{std::move(r.m_option_values)}
+    , m_option_arena{std::move(r.m_option_arena)}
+    , m_option_values_valid{std::exchange(r.m_option_values_valid, false)}
+    , m_options_generation{r.m_options_generation}
+    , m_read_size_policy{r.m_read_size_policy}
+    , m_notify_policy{r.m_notify_policy}
+    , m_memory_policy{std::move(r.m_memory_policy)}
+    , m_frames_policy{r.m_frames_policy}
+    , m_io_wait_timeout{r.m_io_wait_timeout} {
 #ifndef SANE_PP_STUB
-    details::checked_call("unable to get list of devices", ::sane_get_devices, &devices, SANE_TRUE);
+    r.m_handle = nullptr;
+#endif
+}
+
+device::~device() {
+    // The worker should go away before the handle is closed
+    if (m_worker.joinable()) {
+        cancel_scanning();
+        m_worker.request_stop();
+        m_worker.join();
+    }
+
+    if (m_wakeup_fd >= 0)
+        ::close(m_wakeup_fd);
+
+    if (! m_name.empty())
+        m_lib_internal->log<LogLevel::Info>([this]() { return "closed device \"" + m_name + '"'; });
+#ifdef SANE_PP_STUB
+    if (! m_name.empty())
+        m_deletion_cb(m_name);
 #else
-    static const SANE_Device device_descrs[] = {{"dev 1", "factory 1", "dev super rk1", "mfu"},
-        {"dev 2", "factory zzz", "not so super dev", "printer"}};
-    static const SANE_Device* device_descr_ptrs[] = {&device_descrs[0], &device_descrs[1], nullptr};
-    devices = device_descr_ptrs;
+    if (m_handle) {
+        {
+            auto lock = m_lib_internal->lock_enumeration();
+            ::sane_close(m_handle);
+        }
+        m_deletion_cb(m_name);
+    }
 #endif
-    // non-sized range could be returned instead (thus providing sentinel as an end iterator),
-    // but having size property drammatically simplifies user's code
-    auto d_end = devices;
-    for (; *d_end; ++d_end);
-    return std::ranges::subrange(devices, d_end);
 }
 
-device lib::open_device(const char* name) {
-    device::handle_t h = {};
-    std::string sname = name;
-    auto it_names = m_opened_device_names.find(sname);
+std::ranges::subrange<device::option_iterator> device::get_option_infos() const {
+    if (! m_option_descriptors_valid)
+        load_option_descriptors();
+
+    const auto size = static_cast<int>(m_option_descriptors.size()) + 1;
+    return {option_iterator{this, 1}, option_iterator{this, size}};
+}
+
+const ::SANE_Option_Descriptor* device::get_option_info(int pos) const {
+    if (! m_option_descriptors_valid)
+        load_option_descriptors();
+
+    if (pos < 1 || static_cast<std::size_t>(pos) > m_option_descriptors.size())
+        throw error("unable to get option idx=" + std::to_string(pos)
+            + " from device \"" + m_name + '"');
+    return &m_option_descriptors[static_cast<std::size_t>(pos) - 1];
+}
+
+void device::load_option_descriptors() const {
+    m_option_descriptors.clear();
+    m_option_index.clear();
+    m_well_known_options = {};
+    m_option_word_lists.clear();
+    m_sorted_word_lists.clear();
+    m_option_descriptors_valid = false;
+    ++m_option_layout_generation;
+
+#ifdef SANE_PP_STUB
+    for (const auto& opt : m_handle)
+        m_option_descriptors.push_back(opt->m_d);
+#else
+    if (! m_handle) {
+        m_option_descriptors_valid = true;
+        return;
+    }
+
+    auto err = [this](){
+        return "unable to get options count from device \"" + m_name + '"';
+    };
+
+    ::SANE_Int size = 1;
+    auto* zero_descr = ::sane_get_option_descriptor(m_handle, 0);
+    if (! zero_descr || zero_descr->type != ::SANE_TYPE_INT)
+        throw error(err());
+
+    details::checked_call(err, &::sane_control_option, m_handle, 0,
+        SANE_ACTION_GET_VALUE, &size, nullptr);
+
+    m_option_descriptors.reserve(size > 1 ? static_cast<std::size_t>(size) - 1 : 0);
+    for (::SANE_Int pos = 1; pos < size; ++pos) {
+        auto p = ::sane_get_option_descriptor(m_handle, pos);
+        if (! p) {
+            m_option_descriptors.clear();
+            throw error("unable to get option idx=" + std::to_string(pos)
+                + " from device \"" + m_name + '"');
+        }
+        m_option_descriptors.push_back(*p);
+    }
+#endif
+
+    // A backend can rebuild its strings on a reload, so names are copied and descriptors point to
+    // the copies. The index and a comparison with the previous layout rely on them
+    std::size_t names_size = 0;
+    for (const auto& descr : m_option_descriptors)
+        names_size += descr.name ? std::strlen(descr.name) + 1 : 0;
+    m_option_names.assign(names_size, '\0');
+    for (auto p = m_option_names.data(); auto& descr : m_option_descriptors)
+        if (descr.name) {
+            const auto size = std::strlen(descr.name) + 1;
+            descr.name = static_cast<const char*>(std::memcpy(p, descr.name, size));
+            p += size;
+        }
+
+    m_option_index.reserve(m_option_descriptors.size());
+    for (std::size_t i = 0; i < m_option_descriptors.size(); ++i)
+        if (const auto* name = m_option_descriptors[i].name; name && *name)
+            m_option_index.try_emplace(name, static_cast<int>(i) + 1);
+
+    for (std::size_t i = 0; i < m_well_known_options.size(); ++i)
+        if (auto it = m_option_index.find(to_string(static_cast<well_known_option>(i)));
+                it != m_option_index.end())
+            m_well_known_options[i] = it->second;
+
+    m_option_word_lists.resize(m_option_descriptors.size());
+    for (std::size_t i = 0; i < m_option_descriptors.size(); ++i)
+        index_word_list(i);
+
+    m_option_descriptors_valid = true;
+}
+
+void device::index_word_list(std::size_t i) const {
+    const auto& descr = m_option_descriptors[i];
+    auto& ref = m_option_word_lists[i];
+    ref = {};
+    if (descr.constraint_type != SANE_CONSTRAINT_WORD_LIST || ! descr.constraint.word_list)
+        return;
+
+    // The first word is a number of words following it
+    const auto* list = descr.constraint.word_list;
+    ref = {m_sorted_word_lists.size(), static_cast<std::size_t>(std::max<::SANE_Word>(list[0], 0))};
+    m_sorted_word_lists.insert(m_sorted_word_lists.end(), list + 1, list + 1 + ref.m_size);
+    std::sort(m_sorted_word_lists.begin() + static_cast<std::ptrdiff_t>(ref.m_offset),
+        m_sorted_word_lists.end());
+}
+
+void device::backend_get_value(int pos, void* data) const {
+#ifdef SANE_PP_STUB
+    const auto& src = m_handle[static_cast<std::size_t>(pos) - 1]->m_data;
+    const auto size = static_cast<std::size_t>(m_option_descriptors[pos - 1].size);
+    std::memcpy(data, src.data(), std::min(src.size(), size));
+    if (src.size() < size)
+        std::memset(static_cast<char*>(data) + src.size(), 0, size - src.size());
+#else
+    details::checked_call([this, pos](){ return "unable to get value for option idx=" +
+            std::to_string(pos) + " from device \"" + m_name + "\""; },
+        &::sane_control_option, m_handle, pos, SANE_ACTION_GET_VALUE, data, nullptr);
+#endif
+}
+
+::SANE_Int device::backend_set_value(int pos, void* data) {
+    ::SANE_Int flags = {};
+#ifdef SANE_PP_STUB
+    const auto* descr = &m_option_descriptors[pos - 1];
+    if (data) {
+        // Options are found by names, as they move when the first one is dropped
+        auto& opt = *m_handle[static_cast<std::size_t>(pos) - 1];
+        const bool int_list_sample = m_name == "dev 1" && opt.m_name == "n1";
+
+        // A rejected value isn't stored, like a real device does
+        if (int_list_sample && *static_cast<::SANE_Word*>(data) == 10)
+            throw std::runtime_error("text exception while setting the value");
+
+        // A string can be shorter than the option size
+        const auto size = descr->type == SANE_TYPE_STRING
+            ? std::min(::strnlen(static_cast<char*>(data), static_cast<std::size_t>(descr->size)) + 1,
+                static_cast<std::size_t>(descr->size))
+            : static_cast<std::size_t>(descr->size);
+        opt.m_data.assign(static_cast<char*>(data), static_cast<char*>(data) + size);
+
+        if (int_list_sample)
+            reinterpret_cast<::SANE_Word*>(opt.m_data.data())[2] = 2;
+
+        // Depth is available in the color mode only, like in many real backends
+        if (m_name == "dev 1" && descr->name && std::strcmp(descr->name, SANE_NAME_SCAN_MODE) == 0)
+            for (auto& depth : m_handle)
+                if (depth->m_name == SANE_NAME_BIT_DEPTH) {
+                    const auto cap = std::strcmp(static_cast<char*>(data), "Color") == 0
+                        ? depth->m_d.cap & ~SANE_CAP_INACTIVE : depth->m_d.cap | SANE_CAP_INACTIVE;
+                    if (cap != depth->m_d.cap)
+                        flags |= SANE_INFO_RELOAD_OPTIONS;
+                    depth->m_d.cap = cap;
+                }
+
+        if (descr->type == SANE_TYPE_STRING
+                && std::strncmp(static_cast<char*>(data), "test", static_cast<std::size_t>(descr->size)) == 0) {
+            m_handle.erase(m_handle.begin());
+            flags |= SANE_INFO_RELOAD_OPTIONS;
+        }
+    }
+#else
+    details::checked_call([this, pos](){ return "unable to set value for option idx=" +
+            std::to_string(pos) + " from device \"" + m_name + "\""; },
+        &::sane_control_option, m_handle, pos, SANE_ACTION_SET_VALUE, data, &flags);
+#endif
+    return flags;
+}
+
+namespace {
+
+// Inactive options can't be read, buttons and groups don't have values at all
+bool is_readable_option(const ::SANE_Option_Descriptor& descr) {
+    return descr.type != SANE_TYPE_BUTTON && descr.type != SANE_TYPE_GROUP && descr.size > 0
+        && SANE_OPTION_IS_ACTIVE(descr.cap);
+}
+
+} // ns anonymous
+
+bool device::read_option_value(int pos, option_value_slot& slot) const {
+    m_option_read_buffer.assign(slot.m_size, 0);
+    backend_get_value(pos, m_option_read_buffer.data());
+
+    auto dest = option_bytes(slot);
+    const bool changed = ! slot.m_loaded
+        || ! std::equal(m_option_read_buffer.begin(), m_option_read_buffer.end(), dest);
+    if (changed)
+        std::copy(m_option_read_buffer.begin(), m_option_read_buffer.end(), dest);
+    slot.m_loaded = true;
+    return changed;
+}
+
+void device::load_option_values() const {
+    if (! m_option_descriptors_valid)
+        load_option_descriptors();
+
+    m_option_values.assign(m_option_descriptors.size(), {});
+    m_option_values_valid = false;
+
+    std::size_t words = 0;
+    for (std::size_t i = 0; i < m_option_descriptors.size(); ++i) {
+        auto& slot = m_option_values[i];
+        slot.m_offset = words * sizeof(::SANE_Word);
+        slot.m_size = static_cast<std::size_t>(std::max<::SANE_Int>(m_option_descriptors[i].size, 0));
+        words += (slot.m_size + sizeof(::SANE_Word) - 1) / sizeof(::SANE_Word);
+    }
+    m_option_arena.assign(words, 0);
+
+    // Options which can't be read now are read on demand by get_option()
+    for (std::size_t i = 0; i < m_option_descriptors.size(); ++i)
+        if (is_readable_option(m_option_descriptors[i]))
+            read_option_value(static_cast<int>(i) + 1, m_option_values[i]);
+
+    m_option_values_valid = true;
+}
+
+const device::option_value_slot& device::loaded_option_value(int pos) const {
+    const auto descr = get_option_info(pos);
+    if (! m_option_values_valid)
+        load_option_values();
+
+    auto& slot = m_option_values[static_cast<std::size_t>(pos) - 1];
+    if (! slot.m_loaded && descr->size > 0)
+        read_option_value(pos, slot);
+    return slot;
+}
+
+bool device::points_into_option(int pos, const void* data) const {
+    const auto& slot = m_option_values[static_cast<std::size_t>(pos) - 1];
+    const auto begin = option_bytes(slot);
+    return std::less_equal<>{}(begin, data) && std::less<>{}(data, begin + slot.m_size);
+}
+
+void device::throw_option_type_mismatch(int pos) const {
+    if (pos == 0)
+        throw error("no such option in device \"" + m_name + '"');
+    throw error("option idx=" + std::to_string(pos) + " in device \"" + m_name
+        + "\" has a type or size different from requested one");
+}
+
+opt_value_t device::get_option(int pos) const {
+    const auto descr = get_option_info(pos);
+    void* data = option_bytes(loaded_option_value(pos));
+
+    switch (descr->type) {
+    case SANE_TYPE_BOOL:
+        return {std::ref(*static_cast<::SANE_Word*>(data))};
+    case SANE_TYPE_INT:
+    case SANE_TYPE_FIXED:
+        return {std::span{static_cast<::SANE_Word*>(data), descr->size / sizeof(::SANE_Word)}};
+    case SANE_TYPE_STRING:
+        return {static_cast<::SANE_String>(data)};
+    default:
+        return {};
+    }
+}
+
+void* device::option_value_data(int pos, opt_value_t& val) const {
+    const auto* descr = &m_option_descriptors[static_cast<std::size_t>(pos) - 1];
+
+    // The variant should hold the alternative documented for the option type
+    const auto expected_index = descr->type == SANE_TYPE_BOOL ? 1u
+        : descr->type == SANE_TYPE_INT || descr->type == SANE_TYPE_FIXED ? 2u
+        : descr->type == SANE_TYPE_STRING ? 3u : val.index();
+    if (val.index() != expected_index)
+        throw_option_type_mismatch(pos);
+
+    switch (descr->type) {
+    case SANE_TYPE_BOOL:
+        return &std::get<1>(val).get();
+    case SANE_TYPE_INT:
+    case SANE_TYPE_FIXED:
+        if (std::get<2>(val).size() != descr->size / sizeof(::SANE_Word))
+            throw error("invalid size of [array] value to set into option idx="
+                + std::to_string(pos) + " in device \"" + m_name + "\"");
+        return std::get<2>(val).data();
+    case SANE_TYPE_STRING:
+        // Skip to check max size of provided buffer because from a doc: "The
+        // only exception to this rule is that when setting the value of a
+        // string option, the string pointed to by argument v may be shorter
+        // since the backend will stop reading the option value upon
+        // encountering the first NUL terminator in the string."
+        return std::get<3>(val);
+    default:
+        return nullptr;
+    }
+}
+
+void device::refresh_option_values(std::span<const int> positions, bool reload) {
+    if (reload) {
+        // Old names are compared with new ones, so their storage should outlive the reload
+        auto old_descriptors = std::move(m_option_descriptors);
+        auto old_names = std::move(m_option_names);
+        m_option_descriptors_valid = false;
+        load_option_descriptors();
+        refresh_reloaded_option_values(old_descriptors);
+        return;
+    }
+
+    const auto generation = m_options_generation + 1;
+    for (auto pos : positions) {
+        auto& slot = m_option_values[static_cast<std::size_t>(pos) - 1];
+        if (slot.m_size > 0 && read_option_value(pos, slot))
+            slot.m_generation = m_options_generation = generation;
+    }
+}
+
+void device::refresh_reloaded_option_values(
+        std::span<const ::SANE_Option_Descriptor> old_descriptors) {
+    const auto generation = m_options_generation + 1;
+
+    bool same_layout = old_descriptors.size() == m_option_descriptors.size();
+    for (std::size_t i = 0; same_layout && i < old_descriptors.size(); ++i)
+        same_layout = old_descriptors[i].size == m_option_descriptors[i].size
+            && std::strcmp(old_descriptors[i].name ? old_descriptors[i].name : "",
+                m_option_descriptors[i].name ? m_option_descriptors[i].name : "") == 0;
+
+    if (! same_layout) {
+        load_option_values();
+        for (auto& slot : m_option_values)
+            slot.m_generation = generation;
+        m_options_generation = generation;
+        return;
+    }
+
+    // Values are updated in place, so views of options which haven't changed are still valid
+    for (std::size_t i = 0; i < m_option_values.size(); ++i) {
+        auto& slot = m_option_values[i];
+        bool changed = false;
+        if (is_readable_option(m_option_descriptors[i]))
+            changed = read_option_value(static_cast<int>(i) + 1, slot);
+        else
+            changed = std::exchange(slot.m_loaded, false);
+        if (changed)
+            slot.m_generation = m_options_generation = generation;
+    }
+}
+
+namespace {
+
+::SANE_Word snap_to_range(::SANE_Word val, const ::SANE_Range& range) {
+    if (range.max < range.min)
+        return val;
+
+    val = std::clamp(val, range.min, range.max);
+    if (range.quant <= 0)
+        return val;
+
+    // Rounded to the nearest step, but a step beyond the maximum isn't allowed
+    const std::int64_t steps = (std::int64_t{val} - range.min + range.quant / 2) / range.quant;
+    auto snapped = range.min + steps * range.quant;
+    if (snapped > range.max)
+        snapped -= range.quant;
+    return static_cast<::SANE_Word>(snapped);
+}
+
+::SANE_Word snap_to_list(::SANE_Word val, std::span<const ::SANE_Word> sorted) {
+    if (sorted.empty())
+        return val;
+
+    const auto it = std::ranges::lower_bound(sorted, val);
+    if (it == sorted.end())
+        return sorted.back();
+    if (*it == val || it == sorted.begin())
+        return *it;
+
+    // Ties go to the lesser word
+    const auto prev = *(it - 1);
+    return std::int64_t{val} - prev <= std::int64_t{*it} - val ? prev : *it;
+}
+
+} // ns anonymous
+
+bool device::constrain_option_value(int pos, void* data) const {
+    const auto& descr = m_option_descriptors[static_cast<std::size_t>(pos) - 1];
+    if (! SANE_OPTION_IS_SETTABLE(descr.cap) || ! SANE_OPTION_IS_ACTIVE(descr.cap))
+        throw error("option idx=" + std::to_string(pos) + " can't be set now in device \""
+            + m_name + '"');
+    if (! data)
+        return false;
+
+    bool adjusted = false;
+    switch (descr.type) {
+    case SANE_TYPE_BOOL: {
+        auto& word = *static_cast<::SANE_Word*>(data);
+        if (word != SANE_FALSE && word != SANE_TRUE) {
+            word = SANE_TRUE;
+            adjusted = true;
+        }
+        break;
+    }
+    case SANE_TYPE_INT:
+    case SANE_TYPE_FIXED: {
+        const auto& ref = m_option_word_lists[static_cast<std::size_t>(pos) - 1];
+        const std::span<const ::SANE_Word> sorted{m_sorted_word_lists.data() + ref.m_offset,
+            ref.m_size};
+
+        for (auto& word : std::span{static_cast<::SANE_Word*>(data),
+                static_cast<std::size_t>(descr.size) / sizeof(::SANE_Word)}) {
+            auto snapped = word;
+            if (descr.constraint_type == SANE_CONSTRAINT_RANGE && descr.constraint.range)
+                snapped = snap_to_range(word, *descr.constraint.range);
+            else if (descr.constraint_type == SANE_CONSTRAINT_WORD_LIST)
+                snapped = snap_to_list(word, sorted);
+            adjusted = adjusted || snapped != word;
+            word = snapped;
+        }
+        break;
+    }
+    case SANE_TYPE_STRING: {
+        if (descr.constraint_type != SANE_CONSTRAINT_STRING_LIST || ! descr.constraint.string_list)
+            break;
+
+        auto* str = static_cast<char*>(data);
+        const auto* match = static_cast<const char*>(nullptr);
+        for (auto p = descr.constraint.string_list; *p; ++p) {
+            if (std::strcmp(*p, str) == 0)
+                return false;
+            if (! match && ::strcasecmp(*p, str) == 0)
+                match = *p;
+        }
+
+        if (! match)
+            throw error("value \"" + std::string{str} + "\" isn't allowed for option idx="
+                + std::to_string(pos) + " in device \"" + m_name + '"');
+
+        // The same length, so it fits into the passed buffer
+        std::strcpy(str, match);
+        adjusted = true;
+        break;
+    }
+    default:
+        break;
+    }
+    return adjusted;
+}
+
+device::set_opt_result_t device::set_option(int pos, opt_value_t val) {
+    get_option_info(pos);
+    if (! m_option_values_valid)
+        load_option_values();
+
+    const auto data = option_value_data(pos, val);
+    // A value modified in place inside the snapshot can't be compared with the previous one
+    const bool in_place = points_into_option(pos, data);
+    const auto generation = m_options_generation;
+    ::SANE_Int flags;
+
+    try {
+        const bool adjusted = constrain_option_value(pos, data);
+        flags = backend_set_value(pos, data) | (adjusted ? SANE_INFO_INEXACT : 0);
+    } catch (...) {
+        // The snapshot shouldn't keep a value which hasn't been set. If it can't be read back, it's
+        // read on the next get_option()
+        if (in_place) {
+            auto& slot = m_option_values[static_cast<std::size_t>(pos) - 1];
+            try {
+                if (is_readable_option(m_option_descriptors[static_cast<std::size_t>(pos) - 1]))
+                    read_option_value(pos, slot);
+                else
+                    slot.m_loaded = false;
+            } catch (...) {
+                slot.m_loaded = false;
+            }
+        }
+        throw;
+    }
+    refresh_option_values({&pos, 1}, (flags & SANE_INFO_RELOAD_OPTIONS) != 0);
+
+    if (auto& slot = m_option_values[static_cast<std::size_t>(pos) - 1];
+            in_place && slot.m_generation <= generation)
+        slot.m_generation = ++m_options_generation;
+    return flags;
+}
+
+namespace {
+
+// Options which change constraints or presence of others go first. Geometry depends on
+// resolution and a source (a flatbed and a feeder have different scan areas)
+int option_setting_rank(std::string_view name) {
+    static const std::pair<std::string_view, int> ranks[] = {
+        {SANE_NAME_SCAN_SOURCE, 0}, {SANE_NAME_SCAN_MODE, 1}, {SANE_NAME_BIT_DEPTH, 2},
+        {SANE_NAME_SCAN_RESOLUTION, 3}, {SANE_NAME_SCAN_X_RESOLUTION, 3},
+        {SANE_NAME_SCAN_Y_RESOLUTION, 3}, {SANE_NAME_SCAN_TL_X, 4}, {SANE_NAME_SCAN_TL_Y, 4},
+        {SANE_NAME_SCAN_BR_X, 4}, {SANE_NAME_SCAN_BR_Y, 4}};
+
+    for (const auto& [n, rank] : ranks)
+        if (n == name)
+            return rank;
+    return 5;
+}
+
+} // ns anonymous
+
+device::batch_set_result device::set_options(std::span<option_setting_t> values) {
+    if (! m_option_values_valid)
+        load_option_values();
+
+    // Names, types and sizes are validated before the first value is sent to a device. Whether an
+    // option can be set and its constraint are checked right before setting it, as they can be
+    // changed by options set earlier
+    struct step {
+        std::string_view m_name;
+        opt_value_t* m_val;
+        int m_pos;
+        int m_rank;
+        void* m_data;
+        bool m_in_place;
+    };
+    std::vector<step> steps;
+    steps.reserve(values.size());
+    for (auto& [name, val] : values) {
+        const auto pos = find_option(name);
+        if (! pos)
+            throw error("no option \"" + std::string{name} + "\" in device \"" + m_name + '"');
+        const auto data = option_value_data(*pos, val);
+        steps.push_back({name, &val, *pos, option_setting_rank(name), data,
+            points_into_option(*pos, data)});
+    }
+    std::ranges::stable_sort(steps, {}, &step::m_rank);
+
+    std::vector<int> positions;
+    positions.reserve(steps.size());
+    const auto generation = m_options_generation;
+    batch_set_result res;
+    bool reload = false;
+
+    // Descriptors reloaded in the middle are compared with these ones at the end, like after a
+    // single reload. Values are still kept in the layout of these descriptors till then
+    std::vector<::SANE_Option_Descriptor> old_descriptors;
+    std::vector<char> old_names;
+
+    auto refresh = [&] {
+        if (! reload) {
+            refresh_option_values(positions, false);
+            return;
+        }
+        if (! m_option_descriptors_valid)
+            load_option_descriptors();
+        refresh_reloaded_option_values(old_descriptors);
+    };
+
+    try {
+        for (auto& s : steps) {
+            // Options can be added, removed or moved by a reload, so the rest of options are found
+            // again by their names and checked against new descriptors
+            if (reload) {
+                if (! m_option_descriptors_valid)
+                    load_option_descriptors();
+                const auto pos = find_option(s.m_name);
+                if (! pos)
+                    throw error("option \"" + std::string{s.m_name} + "\" has gone from device \""
+                        + m_name + "\" while setting options");
+                s.m_pos = *pos;
+                s.m_data = option_value_data(s.m_pos, *s.m_val);
+            }
+
+            const bool adjusted = constrain_option_value(s.m_pos, s.m_data);
+            const auto flags = backend_set_value(s.m_pos, s.m_data)
+                | (adjusted ? SANE_INFO_INEXACT : 0);
+            positions.push_back(s.m_pos);
+            res.m_flags |= set_opt_result_t{static_cast<unsigned long long>(flags)};
+            if (flags & SANE_INFO_INEXACT)
+                res.m_inexact.push_back(s.m_pos);
+
+            if (flags & SANE_INFO_RELOAD_OPTIONS) {
+                if (! reload) {
+                    old_descriptors = std::move(m_option_descriptors);
+                    old_names = std::move(m_option_names);
+                }
+                reload = true;
+                m_option_descriptors_valid = false;
+            }
+        }
+    } catch (...) {
+        // Keep the snapshot consistent with options set before the failure
+        refresh();
+        throw;
+    }
+
+    refresh();
+    // After a reload with another layout all options are reported anyway, and positions of options
+    // set before it can be out of the new table
+    for (const auto& s : steps)
+        if (static_cast<std::size_t>(s.m_pos) <= m_option_values.size())
+            if (auto& slot = m_option_values[static_cast<std::size_t>(s.m_pos) - 1];
+                    s.m_in_place && slot.m_generation <= generation)
+                slot.m_generation = ++m_options_generation;
+    res.m_changed = changed_options_since(generation);
+    res.m_generation = m_options_generation;
+    return res;
+}
+
+std::optional<int> device::find_option(std::string_view name) const {
+    if (! m_option_descriptors_valid)
+        load_option_descriptors();
+
+    if (auto it = m_option_index.find(name); it != m_option_index.end())
+        return it->second;
+    return {};
+}
+
+std::optional<int> device::find_option(well_known_option opt) const {
+    if (! m_option_descriptors_valid)
+        load_option_descriptors();
+
+    if (opt < well_known_option::last)
+        if (const auto pos = m_well_known_options[static_cast<std::size_t>(opt)]; pos != 0)
+            return pos;
+    return {};
+}
+
+namespace {
+
+// Option profile layout, all numbers are native:
+//   header: magic[4], version (u16), count of options (u16), fingerprint (u64)
+//   an option: name size (u16), name, type (u16), value size (u32), value
+constexpr char s_profile_magic[4] = {'S', 'P', 'P', 'F'};
+constexpr std::uint16_t s_profile_version = 1;
 
-    if (it_names != m_opened_device_names.end())
-        throw error("already having device \"" + sname + "\" somewhere in the program");
-#ifdef SANE_PP_STUB
-    if (std::strcmp(name, "dev 1") == 0) {
-        h = {std::make_shared<details::stub_option>("n0", "int sample", "", SANE_TYPE_INT, SANE_CAP_SOFT_SELECT, 1, SANE_UNIT_MM),
-             std::make_shared<details::stub_option>("n1", "int list sample", "", SANE_TYPE_INT, SANE_CAP_SOFT_SELECT, 3, SANE_UNIT_BIT),
-             std::make_shared<details::stub_option>("n2", "fixed sample", "", SANE_TYPE_FIXED, SANE_CAP_SOFT_SELECT),
-             std::make_shared<details::stub_option>("n3", "fixed list sample", "", SANE_TYPE_FIXED, SANE_CAP_SOFT_SELECT, 3),
-             std::make_shared<details::stub_option>("n4", "str", "", SANE_TYPE_STRING, SANE_CAP_SOFT_SELECT, 32),
-             std::make_shared<details::stub_option>("n5", "btn", "", SANE_TYPE_BUTTON, SANE_CAP_SOFT_SELECT)};
-        h[0]->value<::SANE_Word>() = 2;
-        h[0]->set_int_range_constraint({-6, 6000, 2});
-        h[1]->values<::SANE_Word>() = {1, 2, 3};
-        h[1]->set_int_range_constraint({-10, 10, 1});
-        h[2]->value<::SANE_Fixed>() = 1 << SANE_FIXED_SCALE_SHIFT;
-        h[2]->set_int_range_constraint({0, 10 << SANE_FIXED_SCALE_SHIFT, 1 << (SANE_FIXED_SCALE_SHIFT - 1)});
-        h[3]->values<::SANE_Fixed>() = {1 << SANE_FIXED_SCALE_SHIFT, 2 << SANE_FIXED_SCALE_SHIFT, 5 << (SANE_FIXED_SCALE_SHIFT - 1)};
-        h[4]->str() = "test string";
-    } else {
-        h = {std::make_shared<details::stub_option>("resolution", "resolution", "", SANE_TYPE_INT, 0, 1, SANE_UNIT_DPI)};
-        h[0]->value<::SANE_Word>() = 10;
-    }
-#else
-    details::checked_call([&name](){ return std::string{"unable to get device \""} + name + '"'; },
-        &::sane_open, name, &h);
-#endif
+struct profile_entry {
+    std::string_view m_name;
+    ::SANE_Value_Type m_type;
+    std::span<const std::byte> m_value;
+};
 
-    m_opened_device_names.insert(it_names, sname);
+class profile_reader final {
+public:
+    explicit profile_reader(std::span<const std::byte> data) : m_data{data} {}
 
-    return {std::move(h), std::move(sname), m_internal_iface.get(),
-        [lib_ptr = m_inst_wptr.lock()](const std::string& name) {
-            lib_ptr->m_opened_device_names.erase(name);
-        }};
-}
+    template <typename T>
+    T read() {
+        T res;
+        std::memcpy(&res, take(sizeof(T)).data(), sizeof(T));
+        return res;
+    }
 
-//-----------------------------------------------------------------------------
+    std::span<const std::byte> take(std::size_t size) {
+        if (size > m_data.size())
+            throw error("option profile is corrupted");
+        auto res = m_data.first(size);
+        m_data = m_data.subspan(size);
+        return res;
+    }
 
-device::device(handle_t dev_handle, std::string name, lib::lib_internal* lib_int, deletion_cb_t deletion_cb)
-    : m_handle{std::move(dev_handle)}
-    , m_name{std::move(name)}
-    , m_lib_internal{lib_int}
-    , m_deletion_cb{std::move(deletion_cb)} {
+    bool at_end() const { return m_data.empty(); }
+
+private:
+    std::span<const std::byte> m_data;
+};
 
-    m_lib_internal->log(LogLevel::Info, [this](){ return "opened device \"" + m_name + '"'; });
+template <typename T>
+void append(std::vector<std::byte>& dest, const T& val) {
+    const auto* p = reinterpret_cast<const std::byte*>(&val);
+    dest.insert(dest.end(), p, p + sizeof(T));
 }
 
-device::device(device&& r)
-    : m_handle{std::move(r.m_handle)}
-    , m_name{std::move(r.m_name)}
-    , m_lib_internal{r.m_lib_internal}
-    , m_deletion_cb{std::move(r.m_deletion_cb)} {
-#ifndef SANE_PP_STUB
-    r.m_handle = nullptr;
-#endif
+void append(std::vector<std::byte>& dest, const void* data, std::size_t size) {
+    const auto* p = static_cast<const std::byte*>(data);
+    dest.insert(dest.end(), p, p + size);
 }
 
-device::~device() {
-    if (! m_name.empty())
-        m_lib_internal->log(LogLevel::Info, [this]() { return "closed device \"" + m_name + '"'; });
-#ifdef SANE_PP_STUB
-    if (! m_name.empty())
-        m_deletion_cb(m_name);
-#else
-    if (m_handle) {
-        ::sane_close(m_handle);
-        m_deletion_cb(m_name);
-    }
-#endif
+// FNV-1a
+std::uint64_t hash_bytes(std::uint64_t h, const void* data, std::size_t size) {
+    for (const auto* p = static_cast<const unsigned char*>(data); size > 0; --size, ++p)
+        h = (h ^ *p) * 1099511628211ull;
+    return h;
 }
 
-std::ranges::subrange<device::option_iterator> device::get_option_infos() const {
-    auto err = [this](){
-        return "unable to get options count from device \"" + m_name + '"';
-    };
-#ifdef SANE_PP_STUB
-    ::SANE_Int size = static_cast<::SANE_Int>(m_handle.size() + 1);
-#else
-    ::SANE_Int size = 1;
+constexpr std::uint64_t s_hash_seed = 14695981039346656037ull;
 
-    if (m_handle) {
-        auto* zero_descr = ::sane_get_option_descriptor(m_handle, 0);
-        if (! zero_descr || zero_descr->type != ::SANE_TYPE_INT)
-            throw error(err());
+bool is_profiled_option(const ::SANE_Option_Descriptor& descr) {
+    return SANE_OPTION_IS_SETTABLE(descr.cap) && descr.type != SANE_TYPE_BUTTON
+        && descr.type != SANE_TYPE_GROUP && descr.size > 0 && descr.name && *descr.name;
+}
+
+// Strings are compared and stored till the terminator only
+std::span<const std::byte> profiled_value(const ::SANE_Option_Descriptor& descr,
+                                          const char* data, std::size_t size) {
+    if (descr.type == SANE_TYPE_STRING)
+        size = ::strnlen(data, size);
+    return {reinterpret_cast<const std::byte*>(data), size};
+}
 
-        details::checked_call(err, &::sane_control_option, m_handle, 0,
-            SANE_ACTION_GET_VALUE, &size, nullptr);
+std::pair<std::uint64_t, std::vector<profile_entry>> parse_profile(
+        std::span<const std::byte> profile) {
+    profile_reader r{profile};
+    if (std::memcmp(r.take(sizeof(s_profile_magic)).data(), s_profile_magic,
+            sizeof(s_profile_magic)) != 0)
+        throw error("not an option profile");
+    if (r.read<std::uint16_t>() != s_profile_version)
+        throw error("unsupported version of an option profile");
+
+    std::vector<profile_entry> res(r.read<std::uint16_t>());
+    const auto fingerprint = r.read<std::uint64_t>();
+    for (auto& e : res) {
+        const auto name = r.take(r.read<std::uint16_t>());
+        e.m_name = {reinterpret_cast<const char*>(name.data()), name.size()};
+        e.m_type = static_cast<::SANE_Value_Type>(r.read<std::uint16_t>());
+        e.m_value = r.take(r.read<std::uint32_t>());
     }
-#endif
-    return {option_iterator{this, 1}, option_iterator{this, size}};
+    if (! r.at_end())
+        throw error("option profile is corrupted");
+    return {fingerprint, std::move(res)};
 }
 
-const ::SANE_Option_Descriptor* device::get_option_info(int pos) const {
-#ifdef SANE_PP_STUB
-    return &m_handle[pos-1]->m_d;
-#else
-    if (auto p = ::sane_get_option_descriptor(m_handle, pos))
-        return p;
+} // ns anonymous
 
-    throw error("unable to get option idx=" + std::to_string(pos)
-        + " from device \"" + m_name + '"');
-#endif
+std::uint64_t device::options_fingerprint() const {
+    if (! m_option_descriptors_valid)
+        load_option_descriptors();
+
+    auto h = s_hash_seed;
+    for (const auto& descr : m_option_descriptors) {
+        if (! is_profiled_option(descr))
+            continue;
+        h = hash_bytes(h, descr.name, std::strlen(descr.name) + 1);
+        h = hash_bytes(h, &descr.type, sizeof(descr.type));
+        h = hash_bytes(h, &descr.size, sizeof(descr.size));
+    }
+    return h;
 }
 
-opt_value_t device::get_option(int pos) const {
-    void* data = {};
-    auto descr = get_option_info(pos);
-#ifdef SANE_PP_STUB
-    data = m_handle[static_cast<std::size_t>(pos) - 1]->m_data.data();
-#else
-    m_option_data_buffer.resize(descr->size);
-    data = m_option_data_buffer.data();
-    details::checked_call([this, pos](){ return "unable to get value for option idx=" +
-            std::to_string(pos) + " from device \"" + m_name + "\""; },
-        &::sane_control_option, m_handle, pos, SANE_ACTION_GET_VALUE, data, nullptr);
-#endif
-    switch (descr->type) {
-    case SANE_TYPE_BOOL:
-        return {std::ref(*static_cast<::SANE_Word*>(data))};
-    case SANE_TYPE_INT:
-    case SANE_TYPE_FIXED:
-        return {std::span{static_cast<::SANE_Word*>(data), descr->size / sizeof(::SANE_Word)}};
-    case SANE_TYPE_STRING:
-        return {static_cast<::SANE_String>(data)};
-    default:
-        return {};
+std::vector<std::byte> device::save_profile() const {
+    if (! m_option_values_valid)
+        load_option_values();
+
+    std::vector<std::byte> res;
+    append(res, s_profile_magic);
+    append(res, s_profile_version);
+    const auto count_offset = res.size();
+    append(res, std::uint16_t{});
+    append(res, options_fingerprint());
+
+    std::uint16_t count = 0;
+    for (std::size_t i = 0; i < m_option_descriptors.size(); ++i) {
+        const auto& descr = m_option_descriptors[i];
+        const auto& slot = m_option_values[i];
+        if (! is_profiled_option(descr) || ! SANE_OPTION_IS_ACTIVE(descr.cap) || ! slot.m_loaded)
+            continue;
+
+        const auto value = profiled_value(descr, option_bytes(slot), slot.m_size);
+        const auto name_size = static_cast<std::uint16_t>(std::strlen(descr.name));
+        append(res, name_size);
+        append(res, descr.name, name_size);
+        append(res, static_cast<std::uint16_t>(descr.type));
+        append(res, static_cast<std::uint32_t>(value.size()));
+        append(res, value.data(), value.size());
+        ++count;
     }
+    std::memcpy(res.data() + count_offset, &count, sizeof(count));
+    return res;
 }
 
-device::set_opt_result_t device::set_option(int pos, opt_value_t val) {
-    void* data = {};
-    auto descr = get_option_info(pos);
+bool device::profile_matches(std::span<const std::byte> profile) const {
+    auto [fingerprint, entries] = parse_profile(profile);
+    if (fingerprint != options_fingerprint())
+        return false;
+    if (! m_option_values_valid)
+        load_option_values();
+
+    return std::ranges::all_of(entries, [this](const profile_entry& e) {
+        const auto pos = find_option(e.m_name);
+        if (! pos)
+            return false;
+        const auto i = static_cast<std::size_t>(*pos) - 1;
+        const auto& descr = m_option_descriptors[i];
+        const auto& slot = m_option_values[i];
+        return descr.type == e.m_type && slot.m_loaded
+            && std::ranges::equal(profiled_value(descr, option_bytes(slot), slot.m_size),
+                e.m_value);
+    });
+}
 
-    switch (descr->type) {
-    case SANE_TYPE_BOOL:
-        data = &get<1>(val).get();
-        break;
-    case SANE_TYPE_INT:
-    case SANE_TYPE_FIXED:
-        if (get<2>(val).size() != descr->size / sizeof(::SANE_Word))
-            throw error("invalid size of [array] value to set into option idx="
-                + std::to_string(pos) + " in device \"" + m_name + "\"");
-        data = get<2>(val).data();
-        break;
-    case SANE_TYPE_STRING:
-        // Skip to check max size of provided buffer because from a doc: "The
-        // only exception to this rule is that when setting the value of a
-        // string option, the string pointed to by argument v may be shorter
-        // since the backend will stop reading the option value upon
-        // encountering the first NUL terminator in the string."
-        data = get<3>(val);
-        break;
-    default:
-        break;
+device::batch_set_result device::apply_profile(std::span<const std::byte> profile) {
+    auto [fingerprint, entries] = parse_profile(profile);
+    if (fingerprint != options_fingerprint())
+        throw error("option profile has been made for another model than \"" + m_name + "\" is");
+    if (! m_option_values_valid)
+        load_option_values();
+
+    batch_set_result res;
+    const auto generation = m_options_generation;
+
+    // The first pass can make some options active or change already matching ones
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<std::vector<::SANE_Word>> buffers;
+        std::vector<option_setting_t> settings;
+
+        for (const auto& e : entries) {
+            const auto pos = find_option(e.m_name);
+            if (! pos)
+                continue;
+            const auto i = static_cast<std::size_t>(*pos) - 1;
+            const auto& descr = m_option_descriptors[i];
+            const auto& slot = m_option_values[i];
+            if (descr.type != e.m_type || ! SANE_OPTION_IS_ACTIVE(descr.cap)
+                    || (slot.m_loaded && std::ranges::equal(
+                        profiled_value(descr, option_bytes(slot), slot.m_size), e.m_value)))
+                continue;
+
+            // The C library can change the value in place, so it's copied into an aligned buffer
+            const auto size = std::max(e.m_value.size() + 1, static_cast<std::size_t>(descr.size));
+            auto& buf = buffers.emplace_back((size + sizeof(::SANE_Word) - 1) / sizeof(::SANE_Word));
+            std::memcpy(buf.data(), e.m_value.data(), e.m_value.size());
+
+            switch (descr.type) {
+            case SANE_TYPE_BOOL:
+                settings.emplace_back(e.m_name, std::ref(buf[0]));
+                break;
+            case SANE_TYPE_INT:
+            case SANE_TYPE_FIXED:
+                settings.emplace_back(e.m_name, std::span{buf.data(),
+                    static_cast<std::size_t>(descr.size) / sizeof(::SANE_Word)});
+                break;
+            case SANE_TYPE_STRING:
+                settings.emplace_back(e.m_name, reinterpret_cast<::SANE_String>(buf.data()));
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (settings.empty())
+            break;
+
+        auto pass_res = set_options(settings);
+        res.m_flags |= pass_res.m_flags;
+        res.m_inexact.insert(res.m_inexact.end(), pass_res.m_inexact.begin(),
+            pass_res.m_inexact.end());
     }
 
-    ::SANE_Int flags = {};
-#ifdef SANE_PP_STUB
-    if (data) {
-        m_handle[pos-1]->m_data.assign(
-            static_cast<char*>(data), static_cast<char*>(data) + descr->size);
+    std::ranges::sort(res.m_inexact);
+    res.m_inexact.erase(std::unique(res.m_inexact.begin(), res.m_inexact.end()),
+        res.m_inexact.end());
+    res.m_changed = changed_options_since(generation);
+    res.m_generation = m_options_generation;
+    return res;
+}
 
-        if (m_name == "dev 1" && pos == 2) {
-            auto data = reinterpret_cast<::SANE_Word*>(m_handle[1]->m_data.data());
-            if (*data == 10)
-                throw std::runtime_error("text exception while setting the value");
-            *(data + 2) = 2;
-        }
+std::vector<int> device::changed_options_since(std::uint64_t generation) const {
+    std::vector<int> res;
+    for (std::size_t i = 0; i < m_option_values.size(); ++i)
+        if (m_option_values[i].m_generation > generation)
+            res.push_back(static_cast<int>(i) + 1);
+    return res;
+}
 
-        if (std::memcmp(static_cast<char*>(data), "test", 5) == 0) {
-            m_handle.erase(m_handle.begin());
-            flags |= SANE_INFO_RELOAD_OPTIONS;
-        }
-    }
-#else
-    details::checked_call([this, pos](){ return "unable to set value for option idx=" +
-            std::to_string(pos) + " from device \"" + m_name + "\""; },
-        &::sane_control_option, m_handle, pos, SANE_ACTION_SET_VALUE, data, &flags);
-#endif
+std::future<void> device::start_scanning(std::function<void()> cb) {
+    return start_scanning_impl(std::move(cb), nullptr);
+}
 
-    return flags;
+std::future<void> device::start_scanning(scan_sink& sink, std::function<void()> cb) {
+    return start_scanning_impl(std::move(cb), &sink);
 }
 
-void device::start_scanning(std::function<void()> cb) {
-    if (m_scanning_state != scanning_state::idle)
-        throw std::logic_error("trying to start scanning on \"" + m_name + "\" device "
-            "while the scanning is in progress (state=" + state_to_str(m_scanning_state));
+std::future<void> device::start_scanning_impl(std::function<void()> cb, scan_sink* sink) {
+    {
+        std::lock_guard guard{m_scanning_state_mutex};
+        if (m_scanning_state != scanning_state::idle)
+            throw std::logic_error("trying to start scanning on \"" + m_name + "\" device "
+                "while the scanning is in progress (state=" + state_to_str(m_scanning_state));
+    }
+
+    // A consumer can see the end of the previous operation while the worker is still finishing it,
+    // nothing below may be touched until then. The worker itself (starting from inside the final
+    // notification) doesn't touch anything of the operation after calling the notifier
+    if (std::this_thread::get_id() != m_worker.get_id()) {
+        std::unique_lock lock{m_worker_mutex};
+        m_worker_done.wait(lock, [this](){ return ! m_worker_busy; });
+    }
 
-    m_lib_internal->log(LogLevel::Info, [this](){ return "start scanning on device \"" + m_name + '"'; });
+    m_lib_internal->log<LogLevel::Info>([this](){ return "start scanning on device \"" + m_name + '"'; });
     m_use_internal_waiter = !cb;
     if (m_use_internal_waiter)
         cb = [this](){ m_internal_state_waiting.notify_all(); };
 
-    m_scanning_state_notifier = std::move(cb);
+    m_use_scan_sink = sink != nullptr;
     m_last_scanning_error = {};
     m_scanning_params = {};
     m_use_asynchronous_mode = false;
     m_chunks.clear();
+    if (! m_chunk_pool)
+        m_chunk_pool = std::make_shared<details::chunk_pool>();
+    m_chunks.configure(m_memory_policy.m_budget_bytes, m_memory_policy.m_spill_directory,
+        m_chunk_pool);
+    m_metrics.reset();
+
+    m_scanning_stop_source = {};
 
-    m_scanning_thread = std::jthread([this](std::stop_token s){ do_scanning(std::move(s)); });
+    std::promise<void> started;
+    auto res = started.get_future();
+    {
+        std::lock_guard guard{m_scanning_state_mutex};
+        m_scanning_state = scanning_state::queued;
+    }
+    {
+        std::lock_guard guard{m_worker_mutex};
+        m_worker_requests.push_back(
+            {m_scanning_stop_source.get_token(), std::move(cb), sink, std::move(started)});
+    }
+
+    // Neither the worker thread start nor a device warm-up are waited here, the state changes are
+    // reported by the notifier and the future
+    if (! m_worker.joinable())
+        m_worker = std::jthread([this](std::stop_token s){ worker_loop(std::move(s)); });
+    else
+        m_worker_wakeup.notify_one();
 
-    // Let's wait while the worker thread is started and passed some lines of initialization
-    std::unique_lock lock{m_scanning_state_mutex};
-    m_internal_state_waiting.wait(lock,
-        [this](){ return m_scanning_state != scanning_state::idle; });
+    return res;
 }
 
 void device::cancel_scanning(cancel_mode c_mode) {
     if (m_scanning_state != scanning_state::idle) {
-        m_lib_internal->log(LogLevel::Info, [this](){ return "cancel scanning on device \"" + m_name
+        m_lib_internal->log<LogLevel::Info>([this](){ return "cancel scanning on device \"" + m_name
             + "\" at state " + state_to_str(m_scanning_state); });
 
         // Let's set a 'request to stop' flag in a worker thread regardless of cancel mode
-        m_scanning_thread.request_stop();
+        m_scanning_stop_source.request_stop();
 
         std::unique_lock lock{m_scanning_state_mutex};
         if (m_scanning_state == scanning_state::scanning) {
@@ -318,7 +1748,10 @@ void device::cancel_scanning(cancel_mode c_mode) {
                 // Cancel mode doesn't matter if current device supports asynchronous reading
                 // and it has been initialized successfully - it should work perfectly fine
                 // in this case without other tricks with ::sane_cancel() call.
-                auto r = ::write(m_waiter_pipes[1], "\0", 1);
+                m_cancel_requested_at.store(
+                    std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                const std::uint64_t one = 1;
+                auto r = ::write(m_wakeup_fd, &one, sizeof(one));
                 (void)r;
             }
 #ifndef SANE_PP_STUB
@@ -326,7 +1759,7 @@ void device::cancel_scanning(cancel_mode c_mode) {
             else if (c_mode == cancel_mode::via_signal)
                 // Is it safe to assume that C++'s thread::native_handle() return's pthread_t id?
                 // In general - no, but let's assume it base on experiments. Not so perfect.
-                ::pthread_kill(m_scanning_thread.native_handle(), SIGUSR1);
+                ::pthread_kill(m_worker.native_handle(), SIGUSR1);
 #endif
             else if (c_mode == cancel_mode::direct)
                 ::sane_cancel(m_handle);
@@ -335,6 +1768,16 @@ void device::cancel_scanning(cancel_mode c_mode) {
     }
 }
 
+void device::set_scanning_state(scanning_state val) {
+    {
+        std::lock_guard guard{m_scanning_state_mutex};
+        m_scanning_state = val;
+    }
+
+    m_internal_state_waiting.notify_all();
+    m_scanning_state_notifier();
+}
+
 void device::check_for_scanning_error(std::unique_lock<std::mutex>&& lock) {
     std::exception_ptr ptr;
 
@@ -343,9 +1786,6 @@ void device::check_for_scanning_error(std::unique_lock<std::mutex>&& lock) {
         std::swap(ptr, m_last_scanning_error);
     }
 
-    if ((m_scanning_state == scanning_state::idle || ptr) && m_scanning_thread.joinable())
-        m_scanning_thread.join();
-
     if (ptr)
         std::rethrow_exception(ptr);
 }
@@ -367,125 +1807,328 @@ const ::SANE_Parameters* device::get_scanning_parameters() {
         &m_scanning_params : nullptr;
 }
 
-std::vector<unsigned char> device::get_scanning_data() {
-    if (m_use_internal_waiter) {
-        std::unique_lock lock{m_scanning_state_mutex};
-        m_internal_state_waiting.wait(lock, [this](){
-            return ! m_chunks.empty() || m_last_scanning_error; });
+device::parameters_awaiter device::scan_parameters(executor_t executor) {
+    start_scanning_impl([this, executor = std::move(executor)]() {
+        // Pairs with the fence in suspend_awaiting(): either a coroutine sees the new state or
+        // the handle is seen here
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (! m_awaiting_coroutine.load(std::memory_order_relaxed))
+            return;
+
+        // A notification can be late (e.g. about the starting state), so a coroutine is resumed
+        // only when the thing it waits for is really there
+        const bool ready = m_awaiting_chunk.load(std::memory_order_relaxed)
+            ? ! m_chunks.empty() : scanning_parameters_ready();
+        if (! ready)
+            return;
+
+        if (auto addr = m_awaiting_coroutine.exchange(nullptr))
+            executor(std::coroutine_handle<>::from_address(addr));
+    }, nullptr);
+
+    return parameters_awaiter{this};
+}
 
-        check_for_scanning_error(std::move(lock));
-    } else
-        check_for_scanning_error(std::unique_lock{m_scanning_state_mutex});
+device::chunk_awaiter device::next_chunk() {
+    return chunk_awaiter{this};
+}
 
-    std::vector<unsigned char> res;
+bool device::scanning_parameters_ready() {
+    std::lock_guard guard{m_scanning_state_mutex};
+    return m_scanning_state == scanning_state::scanning
+        || m_scanning_state == scanning_state::idle
+        || m_last_scanning_error;
+}
 
-    {
-        std::lock_guard guard{m_scanning_state_mutex};
-        if (m_chunks.empty())
-            throw std::logic_error("trying to get scanner data on \"" + m_name + "\" device "
-                "while even parameters hasn't been got");
-        res = std::move(m_chunks.front());
-        m_chunks.pop_front();
+template <typename F>
+bool device::suspend_awaiting(std::coroutine_handle<> h, bool chunk, F&& ready) {
+    m_awaiting_chunk.store(chunk, std::memory_order_relaxed);
+    m_awaiting_coroutine.store(h.address(), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (! ready())
+        return true;
+
+    // The state has been reached in between. If a notification has taken the handle already,
+    // it's going to be resumed by the executor, otherwise there is no need to suspend
+    return m_awaiting_coroutine.exchange(nullptr) == nullptr;
+}
+
+bool device::parameters_awaiter::await_suspend(std::coroutine_handle<> h) {
+    return m_device->suspend_awaiting(h, false, [this](){ return await_ready(); });
+}
+
+const ::SANE_Parameters& device::parameters_awaiter::await_resume() {
+    auto* params = m_device->get_scanning_parameters();
+    if (! params)
+        throw std::logic_error("scanning parameters of \"" + m_device->m_name + "\" device "
+            "are resumed too early");
+    return *params;
+}
+
+bool device::chunk_awaiter::await_suspend(std::coroutine_handle<> h) {
+    return m_device->suspend_awaiting(h, true, [this](){ return await_ready(); });
+}
+
+device::scan_view device::scan() {
+    return scan_view{this};
+}
+
+device::scan_view::state::~state() {
+    if (! m_started || m_finished)
+        return;
+
+    // The device should become ready for the next scanning, so the rest of data is thrown away.
+    // A scanning error is thrown only once and followed by the end-of-stream chunk anyway
+    try {
+        m_device->cancel_scanning();
+    } catch (...) {
+    }
+    while (true) {
+        try {
+            if (m_device->get_scanning_data().empty())
+                break;
+        } catch (const std::logic_error&) {
+            break;
+        } catch (...) {
+        }
     }
+}
+
+void device::scan_view::state::fetch() {
+    // The previous chunk goes back to the pool before waiting for the next one
+    m_chunk = {};
+    m_chunk = m_device->get_scanning_data();
+    m_finished = m_chunk.empty();
+}
+
+device::scan_view::iterator device::scan_view::begin() {
+    if (! m_state)
+        throw std::logic_error("scan view isn't bound to any device");
+    if (m_state->m_started)
+        throw std::logic_error("scan view of \"" + m_state->m_device->m_name + "\" device can be "
+            "iterated only once");
+
+    m_state->m_device->start_scanning();
+    m_state->m_started = true;
+    m_state->m_device->get_scanning_parameters();
+    m_state->fetch();
+    return iterator{m_state.get()};
+}
+
+scan_chunk device::get_scanning_data() {
+    if (m_use_scan_sink)
+        throw std::logic_error("trying to get scanner data on \"" + m_name + "\" device "
+            "while the data goes into a scan sink");
+
+    // An error is always followed by the end-of-stream chunk, so it's enough to wait for any chunk
+    if (m_use_internal_waiter)
+        m_chunks.wait_while_empty();
+    check_for_scanning_error(std::unique_lock{m_scanning_state_mutex});
+
+    scan_chunk res;
 
-    if (res.empty() && m_scanning_thread.joinable())
-        m_scanning_thread.join();
+    if (! m_chunks.try_pop(res))
+        throw std::logic_error("trying to get scanner data on \"" + m_name + "\" device "
+            "while even parameters hasn't been got");
+    m_metrics.chunks_popped(1);
 
     return res;
 }
 
-void device::do_scanning(std::stop_token stop_token) {
-    bool cancel_requested = false;
-    ::SANE_Int sane_fd;
-    ::SANE_Status status;
+std::size_t device::get_scanning_data(std::vector<scan_chunk>& dest) {
+    if (m_use_scan_sink)
+        throw std::logic_error("trying to get scanner data on \"" + m_name + "\" device "
+            "while the data goes into a scan sink");
 
-#ifdef SANE_PP_CANCEL_VIA_SIGNAL_SUPPORT
-    g_device_handle = m_handle;
-#endif
+    if (m_use_internal_waiter)
+        m_chunks.wait_while_empty();
+    check_for_scanning_error(std::unique_lock{m_scanning_state_mutex});
 
-    m_lib_internal->log(LogLevel::Debug, "background thread for scanning started");
+    std::size_t count = 0;
+    scan_chunk res;
 
-    try {
-#ifdef SANE_PP_STUB
-        using namespace std::chrono_literals;
+    while (m_chunks.try_pop(res)) {
+        ++count;
+        const bool is_end = res.empty();
+        dest.push_back(std::move(res));
+        if (is_end)
+            break;
+    }
+    m_metrics.chunks_popped(count);
+
+    return count;
+}
 
-        m_sample_image_offset = 0;
+void device::worker_loop(std::stop_token stop_token) {
+    m_lib_internal->log<LogLevel::Debug>("background thread for scanning started");
 
-        m_scanning_state = scanning_state::starting;
-        m_internal_state_waiting.notify_all();
-        m_scanning_state_notifier();
+    while (true) {
+        scan_request req;
 
-        std::this_thread::sleep_for(500ms);
+        {
+            std::unique_lock lock{m_worker_mutex};
+            if (! m_worker_wakeup.wait(lock, stop_token, [this](){ return ! m_worker_requests.empty(); }))
+                break;
+            req = std::move(m_worker_requests.front());
+            m_worker_requests.pop_front();
+            m_worker_busy = true;
+        }
+
+        do_scanning(std::move(req));
+
+        {
+            std::lock_guard guard{m_worker_mutex};
+            m_worker_busy = false;
+        }
+        m_worker_done.notify_all();
+    }
+
+    m_lib_internal->log<LogLevel::Debug>("background thread for scanning finished");
+}
+
+void device::start_frame(::SANE_Parameters& params, ::SANE_Int& sane_fd) {
+#ifdef SANE_PP_STUB
+    using namespace std::chrono_literals;
+
+    m_sample_image_offset = 0;
 
-        // Let's define trivial 32x34 monochrome image with black/white pixels
-        m_scanning_params.format = SANE_FRAME_GRAY;
-        m_scanning_params.last_frame = SANE_TRUE;
-        m_scanning_params.bytes_per_line = 4;
-        m_scanning_params.pixels_per_line = 32;
-        m_scanning_params.lines = 34;
-        m_scanning_params.depth = 1;
+    details::stub_delay(500ms);
 
-        m_lib_internal->log(LogLevel::Debug, "parameters got, going to extract test data in synchronous mode");
+    // Let's define trivial 32x34 monochrome image with black/white pixels
+    params.format = SANE_FRAME_GRAY;
+    params.last_frame = SANE_TRUE;
+    params.bytes_per_line = 4;
+    params.pixels_per_line = 32;
+    params.lines = 34;
+    params.depth = 1;
 
-        m_scanning_state = scanning_state::scanning;
-        m_internal_state_waiting.notify_all();
-        m_scanning_state_notifier();
+    m_lib_internal->log<LogLevel::Debug>("parameters got, going to extract test data in synchronous mode");
 #else
-        m_scanning_state = scanning_state::starting;
-        m_internal_state_waiting.notify_all();
-        m_scanning_state_notifier();
-
-        details::checked_call("unable to start scanning", &::sane_start, m_handle);
-
-        details::checked_call("unable to get scan parameters", &::sane_get_parameters,
-            m_handle, &m_scanning_params);
-
-        m_lib_internal->log(LogLevel::Debug,
-            [this](){ return std::string{"parameters got (last_frame="}
-                + (m_scanning_params.last_frame == SANE_TRUE ? "TRUE" : "FALSE")
-                + "), going to extract data in asynchronous mode"; });
-
-        while (true) {
-            if (status = ::sane_set_io_mode(m_handle, SANE_TRUE); status == SANE_STATUS_GOOD) {
-                if (::pipe(m_waiter_pipes) == 0) {
-                    if (status = ::sane_get_select_fd(m_handle, &sane_fd); status == SANE_STATUS_GOOD) {
-                        m_use_asynchronous_mode = true;
-                        break;
-                    }
-
-                    m_lib_internal->log(LogLevel::Debug,
-                        [status](){ return "failed to get waiting file descriptor from underlying library: "
-                            + std::string{::sane_strstatus(status)}; });
-
-                    ::close(m_waiter_pipes[0]);
-                    ::close(m_waiter_pipes[1]);
-                } else {
-                    m_lib_internal->log(LogLevel::Debug,
-                        [err = errno](){ return "failed to create waiting pipes with code "
-                            + std::to_string(err); });
+    ::SANE_Status status;
+
+    details::checked_call("unable to start scanning", &::sane_start, m_handle);
+
+    details::checked_call("unable to get scan parameters", &::sane_get_parameters,
+        m_handle, &params);
+
+    m_lib_internal->log<LogLevel::Debug>(
+        [&params](){ return std::string{"parameters got (last_frame="}
+            + (params.last_frame == SANE_TRUE ? "TRUE" : "FALSE")
+            + "), going to extract data in asynchronous mode"; });
+
+    bool async = false;
+    while (true) {
+        if (status = ::sane_set_io_mode(m_handle, SANE_TRUE); status == SANE_STATUS_GOOD) {
+            // The wake-up descriptor is created once and lives as long as the device
+            if (m_wakeup_fd >= 0 || (m_wakeup_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0) {
+                if (status = ::sane_get_select_fd(m_handle, &sane_fd); status == SANE_STATUS_GOOD) {
+                    // Drop a wake-up left by cancelling of a previous operation if any
+                    std::uint64_t counter;
+                    auto r = ::read(m_wakeup_fd, &counter, sizeof(counter));
+                    (void)r;
+
+                    async = true;
+                    break;
                 }
 
-                m_lib_internal->log(LogLevel::Debug, "switching back into synchronous mode");
-                ::sane_set_io_mode(m_handle, SANE_FALSE);
+                m_lib_internal->log<LogLevel::Debug>(
+                    [status](){ return "failed to get waiting file descriptor from underlying library: "
+                        + std::string{::sane_strstatus(status)}; });
             } else {
-                m_lib_internal->log(LogLevel::Debug,
-                    [status](){ return std::string{"failed to switch into asynchronous mode: "}
-                        + ::sane_strstatus(status); });
+                m_lib_internal->log<LogLevel::Debug>(
+                    [err = errno](){ return "failed to create wake-up eventfd with code "
+                        + std::to_string(err); });
             }
-            break;
+
+            m_lib_internal->log<LogLevel::Debug>("switching back into synchronous mode");
+            ::sane_set_io_mode(m_handle, SANE_FALSE);
+        } else {
+            m_lib_internal->log<LogLevel::Debug>(
+                [status](){ return std::string{"failed to switch into asynchronous mode: "}
+                    + ::sane_strstatus(status); });
         }
+        break;
+    }
 
-        m_scanning_state = scanning_state::scanning;
-        m_internal_state_waiting.notify_all();
-        m_scanning_state_notifier();
+    std::lock_guard guard{m_scanning_state_mutex};
+    m_use_asynchronous_mode = async;
 #endif
+}
+
+void device::do_scanning(scan_request req) {
+    const auto& stop_token = req.m_stop_token;
+    auto* const sink = req.m_sink;
+    bool cancel_requested = false;
+    bool start_reported = false;
+    ::SANE_Int sane_fd;
+    ::SANE_Status status;
+    ::SANE_Parameters frame_params = {};
+    std::optional<frame_interleaver> interleaver;
+    // The worker owns the whole multi-frame sequence then
+    const bool all_frames = m_frames_policy.m_all_frames;
+
+#ifdef SANE_PP_CANCEL_VIA_SIGNAL_SUPPORT
+    t_device_handle = m_handle;
+#endif
+
+    m_scanning_state_notifier = std::move(req.m_notifier);
+    m_lib_internal->log<LogLevel::Debug>("background scanning started");
+    m_metrics.started();
+
+    try {
+#ifdef SANE_PP_STUB
+        using namespace std::chrono_literals;
+#endif
+        // Cancelled while waiting in the queue
+        if (stop_token.stop_requested())
+            throw error_with_code("[cancel flag request]", SANE_STATUS_CANCELLED);
+
+        set_scanning_state(scanning_state::starting);
+
+        start_frame(frame_params, sane_fd);
+        m_scanning_params = frame_params;
+        if (all_frames) {
+            // The whole image goes by this operation, a consumer shouldn't restart it
+            m_scanning_params.last_frame = SANE_TRUE;
+            if (m_frames_policy.m_interleave && frame_params.format != SANE_FRAME_GRAY
+                && frame_params.format != SANE_FRAME_RGB) {
+
+                if (frame_interleaver::supports(frame_params)) {
+                    interleaver.emplace(frame_params);
+                    m_scanning_params = interleaver->interleaved_parameters();
+                } else
+                    m_lib_internal->log<LogLevel::Info>([&frame_params](){
+                        return "frames with depth=" + std::to_string(frame_params.depth)
+                            + " can't be interleaved, they are passed as they are"; });
+            }
+        }
+        m_metrics.parameters_got();
+
+        set_scanning_state(scanning_state::scanning);
+        req.m_started.set_value();
+        start_reported = true;
+
+        if (sink)
+            sink->parameters_got(m_scanning_params);
 
         bool run = true;
         std::size_t was_read_totally = 0;
+        read_size_tuner read_size{m_read_size_policy, frame_params};
+        notify_coalescer notifier{m_notify_policy};
+
+        const auto deliver = [&](scan_chunk&& chunk, std::size_t size) {
+            chunk.resize(size);
+            const bool was_empty = m_chunks.push(std::move(chunk));
+            m_metrics.chunk_pushed();
+            if (notifier.chunk_pushed(size, was_empty)) {
+                m_metrics.consumer_notified();
+                m_scanning_state_notifier();
+            }
+        };
 
         while (run) {
             const bool do_stop = stop_token.stop_requested();
-            m_lib_internal->log(LogLevel::Debug, [do_stop](){
+            m_lib_internal->log<LogLevel::Debug>([do_stop](){
                 return std::string{"check whether to stop -> "} + (do_stop ? "[true]" : "[false]"); });
             if (do_stop) {
 #ifndef SANE_PP_STUB
@@ -496,76 +2139,135 @@ void device::do_scanning(std::stop_token stop_token) {
                 throw error_with_code("[cancel flag request]", SANE_STATUS_CANCELLED);
             }
 
-            std::vector<unsigned char> chunk(4096*2);
+            // Data goes either right into a sink's memory, into a plane kept for interleaving or
+            // into a pooled chunk for the queue
+            const bool to_plane = interleaver && interleaver->collecting();
+            const bool to_sink = sink && ! interleaver;
+            scan_chunk chunk;
+            std::span<unsigned char> dest;
             std::size_t was_read = 0;
 
-            m_lib_internal->log(LogLevel::Debug,
-                [&chunk, was_read_totally](){
-                    return "going to read up to " + std::to_string(chunk.size())
+            if (to_plane)
+                dest = interleaver->plane_dest(read_size.block_size());
+            else if (to_sink) {
+                dest = sink->acquire(read_size.block_size());
+                if (dest.empty())
+                    throw error("scan sink of device \"" + m_name + "\" refused to accept more data");
+                dest = dest.first(std::min(dest.size(), read_size.block_size()));
+            } else {
+                chunk = scan_chunk{m_chunk_pool, read_size.block_size()};
+                dest = {chunk.writable_data(), read_size.block_size()};
+            }
+
+            m_lib_internal->log<LogLevel::Debug>(
+                [&dest, was_read_totally](){
+                    return "going to read up to " + std::to_string(dest.size())
                         + " bytes at offset " + std::to_string(was_read_totally); });
 
+            const auto read_started_at = m_metrics.now();
 #ifdef SANE_PP_STUB
-            was_read = std::min({chunk.size(), std::size(details::g_sample_image) - m_sample_image_offset, (size_t)11});
+            was_read = std::min({dest.size(), std::size(details::g_sample_image) - m_sample_image_offset, (size_t)11});
             std::copy(details::g_sample_image + m_sample_image_offset,
-                details::g_sample_image + m_sample_image_offset + was_read, chunk.data());
+                details::g_sample_image + m_sample_image_offset + was_read, dest.data());
             m_sample_image_offset += was_read;
-            std::this_thread::sleep_for(300ms);
-            chunk.resize(was_read);
-            if (! chunk.empty()) {
-                {
-                    std::lock_guard guard{m_scanning_state_mutex};
-                    m_chunks.push_back(std::move(chunk));
-                }
-                m_scanning_state_notifier();
-            } else
+            read_size.update(was_read);
+            details::stub_delay(300ms);
+            m_metrics.read_done(read_started_at, was_read);
+            if (was_read == 0)
                 run = false;
 #else
             ::SANE_Int len = 0;
 
             if (m_use_asynchronous_mode) {
-                fd_set async_mode_fds;
-                FD_ZERO(&async_mode_fds);
-                FD_SET(sane_fd, &async_mode_fds);
-                FD_SET(m_waiter_pipes[0], &async_mode_fds);
+                ::pollfd fds[2] = {{sane_fd, POLLIN, 0}, {m_wakeup_fd, POLLIN, 0}};
+                const int timeout_ms = m_io_wait_timeout.count() > 0
+                    ? static_cast<int>(m_io_wait_timeout.count()) : -1;
+
+                int r;
+                do {
+                    r = ::poll(fds, std::size(fds), timeout_ms);
+                } while (r < 0 && errno == EINTR);
 
-                auto r = ::select(std::max(sane_fd, m_waiter_pipes[0]) + 1,
-                    &async_mode_fds, nullptr, nullptr, nullptr);
                 if (r < 0)
                     throw std::system_error(errno, std::generic_category(),
-                        "unable to 'select' on scanner and inner pipe file descriptors");
-                if (FD_ISSET(m_waiter_pipes[0], &async_mode_fds)) {
+                        "unable to 'poll' on scanner and inner wake-up file descriptors");
+                if (r == 0)
+                    throw error_with_code("no data from scanner within "
+                        + std::to_string(m_io_wait_timeout.count()) + " ms", SANE_STATUS_IO_ERROR);
+                if (fds[1].revents & POLLIN) {
+                    m_lib_internal->log<LogLevel::Debug>([this](){
+                        const auto latency = std::chrono::steady_clock::now().time_since_epoch().count()
+                            - m_cancel_requested_at.load(std::memory_order_relaxed);
+                        return "cancel request woke the worker up in "
+                            + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::duration{latency}).count()) + " us"; });
+
                     ::sane_cancel(m_handle);
-                    throw error_with_code("[cancel pipe request]", SANE_STATUS_CANCELLED);
+                    throw error_with_code("[cancel wake-up request]", SANE_STATUS_CANCELLED);
                 }
             }
 
-            status = ::sane_read(m_handle, chunk.data(), chunk.size(), &len);
+            status = ::sane_read(m_handle, dest.data(), static_cast<::SANE_Int>(dest.size()), &len);
 
             if (status != SANE_STATUS_GOOD && status != SANE_STATUS_EOF)
                 throw error_with_code("unable to read next packet of data from scanner", status);
 
             was_read = len;
-            chunk.resize(was_read);
-            if (! chunk.empty()) {
-                {
-                    std::lock_guard guard{m_scanning_state_mutex};
-                    m_chunks.push_back(std::move(chunk));
-                }
-                m_scanning_state_notifier();
-            }
+            read_size.update(was_read);
+            m_metrics.read_done(read_started_at, was_read);
 
             if (status == SANE_STATUS_EOF)
                 run = false;
 #endif
-            m_lib_internal->log(LogLevel::Debug,
+            if (to_plane)
+                interleaver->commit_plane(was_read);
+            else if (interleaver) {
+                // Rows of the last plane are turned into complete RGB rows right away
+                const std::span<const unsigned char> data{chunk.data(), was_read};
+                if (const auto size = interleaver->output_size(was_read); size != 0) {
+                    scan_chunk rows{m_chunk_pool, size};
+                    interleaver->interleave(data, rows.writable_data());
+                    rows.resize(size);
+                    rows.set_frame(SANE_FRAME_RGB);
+                    if (sink)
+                        copy_into_sink(*sink, rows);
+                    else
+                        deliver(std::move(rows), size);
+                } else
+                    interleaver->interleave(data, nullptr);
+            } else if (was_read != 0) {
+                if (sink)
+                    sink->commit(was_read);
+                else {
+                    chunk.set_frame(frame_params.format);
+                    deliver(std::move(chunk), was_read);
+                }
+            }
+
+            m_lib_internal->log<LogLevel::Debug>(
                 [was_read, was_read_totally](){
                     return "have read " + std::to_string(was_read) + " bytes at offset "
                         + std::to_string(was_read_totally); });
 
             was_read_totally += was_read;
+
+            // The next frame of a multi-pass image is started right away without waiting for
+            // a consumer
+            if (! run && all_frames && frame_params.last_frame != SANE_TRUE) {
+                start_frame(frame_params, sane_fd);
+                if (interleaver)
+                    interleaver->start_frame(frame_params);
+                else if (sink)
+                    sink->parameters_got(frame_params);
+                read_size = read_size_tuner{m_read_size_policy, frame_params};
+                was_read_totally = 0;
+                run = true;
+            }
         }
+        if (interleaver)
+            interleaver->finish();
     } catch (const error_with_code& e) {
-        m_lib_internal->log(LogLevel::Debug, [&e](){
+        m_lib_internal->log<LogLevel::Debug>([&e](){
             return std::string{"scanning cycle interrupted by an exception {"} + e.what()
                 + "} with code " + std::to_string(e.get_code()); });
         if (e.get_code() == SANE_STATUS_CANCELLED)
@@ -574,16 +2276,25 @@ void device::do_scanning(std::stop_token stop_token) {
             std::lock_guard guard{m_scanning_state_mutex};
             m_last_scanning_error = std::current_exception();
         }
+        if (! start_reported)
+            req.m_started.set_exception(std::current_exception());
     } catch (...) {
-        m_lib_internal->log(LogLevel::Debug, "scanning cycle interrupted by some exception");
-        std::lock_guard guard{m_scanning_state_mutex};
-        m_last_scanning_error = std::current_exception();
+        m_lib_internal->log<LogLevel::Debug>("scanning cycle interrupted by some exception");
+        {
+            std::lock_guard guard{m_scanning_state_mutex};
+            m_last_scanning_error = std::current_exception();
+        }
+        if (! start_reported)
+            req.m_started.set_exception(std::current_exception());
     }
 
 #ifndef SANE_PP_STUB
+    // A consumer restarts for the next frame itself, unless all frames are acquired here - then
+    // an image broken in the middle should be cancelled, otherwise the next start would get the
+    // next pass of it
     if (m_scanning_state == scanning_state::scanning
         && ! cancel_requested
-        && m_scanning_params.last_frame == SANE_TRUE)
+        && (frame_params.last_frame == SANE_TRUE || all_frames))
 
         ::sane_cancel(m_handle);
 #endif
@@ -591,23 +2302,47 @@ void device::do_scanning(std::stop_token stop_token) {
     {
         std::lock_guard guard{m_scanning_state_mutex};
 
-        if (m_use_asynchronous_mode) {
-            ::close(m_waiter_pipes[0]);
-            ::close(m_waiter_pipes[1]);
+        if (m_use_asynchronous_mode)
             m_use_asynchronous_mode = false;
-        }
 #ifdef SANE_PP_CANCEL_VIA_SIGNAL_SUPPORT
         else
-            g_device_handle = {};
+            t_device_handle = {};
 #endif
+    }
 
-        m_chunks.push_back(std::vector<unsigned char>{});
+    if (sink) {
+        std::exception_ptr ptr;
+        {
+            std::lock_guard guard{m_scanning_state_mutex};
+            ptr = m_last_scanning_error;
+        }
+        sink->finished(ptr);
     }
 
-    m_scanning_state = scanning_state::idle;
-    m_scanning_state_notifier();
+    // A consumer can start the next scanning as soon as it sees the end-of-stream chunk, so the
+    // state should be idle by that time. Such a start waits for this request to be completed by
+    // worker_loop(), only a start from inside the notifier doesn't - so nothing of the operation
+    // is touched after calling it. The notifier is taken out because the next start request
+    // brings its own one.
+    m_metrics.finished();
+    if (! sink) {
+        if (auto spilled = m_chunks.spilled_bytes(); spilled != 0)
+            m_lib_internal->log<LogLevel::Debug>([spilled](){
+                return std::to_string(spilled) + " bytes of scanned data have been spilled "
+                    "out of memory"; });
+        m_metrics.chunk_pushed();
+    }
+    m_lib_internal->log<LogLevel::Debug>("background scanning finished");
 
-    m_lib_internal->log(LogLevel::Debug, "background scanning finished");
+    auto notifier = std::move(m_scanning_state_notifier);
+    {
+        std::lock_guard guard{m_scanning_state_mutex};
+        m_scanning_state = scanning_state::idle;
+    }
+    if (! sink)
+        m_chunks.push(scan_chunk{});
+    m_internal_state_waiting.notify_all();
+    notifier();
 }
 
 } // ns vg_sane
@@ -5,6 +5,11 @@
 #include "sane_wrapper_stub.h"
 #endif
 
+#include "sane_wrapper_buffers.h"
+#include "sane_wrapper_metrics.h"
+#include "sane_wrapper_device_list.h"
+#include "sane_wrapper_options.h"
+
 #include <memory>
 #include <string>
 #include <string_view>
@@ -12,16 +17,26 @@
 #include <vector>
 #include <list>
 #include <set>
+#include <array>
+#include <unordered_map>
+#include <optional>
 #include <bitset>
 #include <ranges>
 #include <variant>
 #include <span>
 #include <functional>
+#include <coroutine>
+#include <exception>
+#include <future>
 #include <thread>
+#include <stop_token>
+#include <chrono>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 
 #include <sane/sane.h>
+#include <sane/saneopts.h>
 #include <pthread.h>
 
 namespace vg_sane {
@@ -34,19 +49,23 @@ using devices_t = std::ranges::subrange<const ::SANE_Device**>;
 using logger_sink_t = std::function<void(LogLevel, std::string_view)>;
 
 /**
- * A holder type of various SANE types. Indexed as:
- *     * [0] (std::monostate) - for SANE_TYPE_BUTTON, SANE_TYPE_GROUP
- *     * [1] (::SANE_Word&) - for SANE_TYPE_BOOL
- *     * [2] (std::span<::SANE_Word>) - for SANE_TYPE_INT, SANE_TYPE_FIXED (they could be arrays)
- *     * [3] (::SANE_String) - for SANE_TYPE_STRING
- *
- * Underlying types are exposed here via C++ wrapper public interface for increasing efficiency
- * because the C library can slighly modify an option value even while a caller wants to set it for
- * a device. But it's still a design question: whether it's better to fully isolate underlying
- * library and the way data types are represented?
+ * Standard options from <sane/saneopts.h> used by almost every scanning program. They are resolved
+ * by device::find_option() through a small fixed table instead of looking a name up.
  */
-using opt_value_t = std::variant<
-    std::monostate, std::reference_wrapper<::SANE_Word>, std::span<::SANE_Word>, ::SANE_String>;
+enum class well_known_option : char {
+    source, mode, depth, resolution, x_resolution, y_resolution, tl_x, tl_y, br_x, br_y, preview,
+    last
+};
+
+inline constexpr const char* to_string(well_known_option opt) {
+    constexpr const char* names[] = {SANE_NAME_SCAN_SOURCE, SANE_NAME_SCAN_MODE,
+        SANE_NAME_BIT_DEPTH, SANE_NAME_SCAN_RESOLUTION, SANE_NAME_SCAN_X_RESOLUTION,
+        SANE_NAME_SCAN_Y_RESOLUTION, SANE_NAME_SCAN_TL_X, SANE_NAME_SCAN_TL_Y, SANE_NAME_SCAN_BR_X,
+        SANE_NAME_SCAN_BR_Y, SANE_NAME_PREVIEW};
+    static_assert(std::size(names) == static_cast<std::size_t>(well_known_option::last));
+
+    return opt < well_known_option::last ? names[static_cast<std::size_t>(opt)] : "";
+}
 
 inline const char* to_string(LogLevel sev) {
     switch (sev) {
@@ -69,40 +88,98 @@ public:
 
     using ptr_t = std::shared_ptr<lib>;
     using wptr_t = std::weak_ptr<lib>;
+    using device_list_ptr_t = std::shared_ptr<const device_list>;
+
+    /**
+     * Called from a background thread after every refresh of the device list cache. On failure
+     * the previous snapshot is passed together with the error.
+     */
+    using device_list_listener_t = std::function<void(device_list_ptr_t, std::exception_ptr)>;
+
+    struct device_cache_policy {
+        /// A snapshot older than this is refreshed at the background on the next request
+        std::chrono::milliseconds m_ttl = std::chrono::seconds{30};
+    };
 
     static ptr_t instance();
 
     /**
      * @returns random-iterable range of SANE device infos. No caching, each call to this method
-     *    makes a call to underlying C library.
+     *    makes a call to underlying C library. The range is valid till the next call of this
+     *    method or till the next refresh of the device list cache.
      */
     devices_t get_device_infos() const;
 
+    /**
+     * Never waits for backends. If the cached snapshot is older than the TTL or devices haven't
+     * been enumerated yet, a refresh is started at the background and the current (maybe empty)
+     * snapshot is returned right away.
+     */
+    device_list_ptr_t get_cached_device_infos();
+
+    /**
+     * Start a refresh of the device list cache at the background regardless of the TTL. Requests
+     * made before the refresh thread picks them up are coalesced into one enumeration.
+     *
+     * @returns future to get the new snapshot from or an error of enumeration
+     */
+    std::shared_future<device_list_ptr_t> refresh_device_infos();
+
+    void set_device_cache_policy(device_cache_policy policy);
+    device_cache_policy get_device_cache_policy() const;
+
+    /**
+     * Set a callback notified about every refresh of the device list cache. When this method
+     * returns, the previous callback is guaranteed not to be running anymore, so it shouldn't
+     * be called from inside the callback itself.
+     */
+    void set_device_list_listener(device_list_listener_t cb = {});
+
     /**
      * Open a scanner device specified by name. Only one scanner with specified name can exist in
-     * the process - this wrapper library checks it. The call can fail even if such a name was
+     * the process - this wrapper library checks it. Can be called from different threads, devices
+     * opened are able to scan simultaneously. The call can fail even if such a name was
      * observed by enumerating entities from get_device_infos() call. A real scanner could be
-     * unplugged between two calls.
+     * unplugged between two calls. Opening and closing of devices never overlap with enumeration
+     * (including a refresh of the device list cache at the background) - many backends aren't
+     * reentrant here.
      */
     device open_device(const char* name);
 
     /**
      * Set optional callback which will be used to send various logging information. The callback
-     * should be thread-safe - more than one thread can call it simultaneously.
+     * should be thread-safe - more than one thread can call it simultaneously. The sink can be
+     * replaced at any time, a message logged meanwhile goes to either the previous or the new one.
+     * When this method returns, the previous sink is called only by threads which have been
+     * logging at that moment.
+     *
+     * @param asynchronous if true, messages are passed to the callback from a separate thread
+     *    through a preallocated queue, so a slow callback never stalls scanning. Messages are
+     *    truncated to about 250 characters then, and dropped if the queue is full (the number of
+     *    dropped messages is reported later).
      */
-    void set_logger_sink(logger_sink_t cb = {}) {
-        m_logger_sink = cb;
-    }
+    void set_logger_sink(logger_sink_t cb = {}, bool asynchronous = false);
+
+    /**
+     * Set minimal level of messages sent to a logger sink, Info by default. Messages below it
+     * aren't even built, so the default keeps the scanning loop free of formatting - Debug
+     * messages are produced for every read. Note that levels below SANE_PP_MIN_LOG_LEVEL
+     * compile-time definition are never logged.
+     */
+    void set_log_level(LogLevel level) { m_log_level.store(level, std::memory_order_relaxed); }
+    LogLevel get_log_level() const { return m_log_level.load(std::memory_order_relaxed); }
 
     ~lib();
 
 private:
     static wptr_t m_inst_wptr;
+    static std::mutex m_inst_mutex;
 
     std::unique_ptr<lib_internal> m_internal_iface;
     ::SANE_Int m_sane_ver;
+    std::mutex m_opened_device_names_mutex;
     std::set<std::string> m_opened_device_names;
-    logger_sink_t m_logger_sink;
+    std::atomic<LogLevel> m_log_level = LogLevel::Info;
 
     lib();
 
@@ -110,6 +187,42 @@ private:
     lib& operator=(const lib&) = delete;
 };
 
+/**
+ * A destination for scanned data which is able to accept it in place, without intermediate chunks.
+ * Used by device::start_scanning(scan_sink&, ...) overload - a scanner fills memory regions given
+ * by the sink directly (next rows of a destination image, a mapped file region, etc). All methods
+ * are called in a context of the scanning worker thread.
+ */
+struct scan_sink {
+    virtual ~scan_sink() = default;
+
+    /**
+     * Called once the image parameters are known, before any data
+     */
+    virtual void parameters_got(const ::SANE_Parameters& params) = 0;
+
+    /**
+     * @param size_hint is an amount of bytes the worker would like to read at once
+     * @returns writable region for next data. Returning empty region aborts the scanning with an
+     *    error
+     */
+    virtual std::span<unsigned char> acquire(std::size_t size_hint) = 0;
+
+    /**
+     * Tells that first `size` bytes of the region returned by the last acquire() call are filled
+     * with data. The rest of the region is left untouched and can be returned again.
+     */
+    virtual void commit(std::size_t size) = 0;
+
+    /**
+     * Called at the end of the scanning, the last call for the operation. A sink shouldn't start
+     * new scanning from inside this call.
+     *
+     * @param error is null at normal end or if the operation has been cancelled
+     */
+    virtual void finished(std::exception_ptr error) = 0;
+};
+
 /**
  * Represents particular scanner. The object is not copyable because the scanner can't be copied in
  * real world.
@@ -141,6 +254,59 @@ public:
 
     using set_opt_result_t = std::bitset<static_cast<std::size_t>(set_opt_result_flags::last)>;
 
+    /**
+     * Controls how much data is requested by one sane_read() call while scanning. The size is
+     * always a whole number of scan lines (if a device reports line length), it's doubled every
+     * time a scanner fills a requested block completely and halved when a scanner returns less
+     * than a quarter of it. Bigger blocks mean fewer calls and consumer wake-ups, smaller ones -
+     * lower latency of every single chunk.
+     */
+    struct read_size_policy {
+        std::size_t m_min_lines = 1;                ///< lower bound of a block in scan lines
+        std::size_t m_initial_bytes = 4096 * 2;     ///< approximate size of the first block
+        std::size_t m_max_bytes = 256 * 1024;       ///< upper bound (cap) of a block in bytes
+    };
+
+    /**
+     * Controls how often the notification callback is called for new data while scanning. By
+     * default it's called for every chunk. In coalescing mode it's called only when a chunk is
+     * pushed into an empty queue - it's assumed that a consumer drains all pending chunks in one go
+     * by get_scanning_data(std::vector<scan_chunk>&) call. The notification can be additionally
+     * delayed until a byte watermark is reached or a time window passes (whichever comes first),
+     * both are checked when next chunks arrive. State changes are always notified immediately.
+     */
+    struct notify_policy {
+        bool m_coalesce = false;                        ///< notify on empty -> non-empty only
+        std::size_t m_bytes_watermark = 0;              ///< 0 - don't wait for more bytes
+        std::chrono::milliseconds m_time_window = {};   ///< 0 - don't wait for more time
+    };
+
+    /**
+     * Limits memory taken by scanned data which a consumer hasn't got yet. A scanner can't be
+     * paused, so data beyond the budget is written into an unlinked temporary file in the given
+     * directory (or into an anonymous memory file if the directory is empty) and read back
+     * transparently by get_scanning_data(). Not applied to scanning into a scan_sink.
+     */
+    struct memory_policy {
+        std::size_t m_budget_bytes = 0;     ///< 0 - unlimited, nothing is spilled
+        std::string m_spill_directory;      ///< should be on a filesystem supporting O_TMPFILE
+    };
+
+    /**
+     * Controls acquisition of images consisting of a few frames - three-pass scanners send red,
+     * green and blue planes one after another. By default every frame is a separate scanning
+     * operation. In all-frames mode the next frame is started by the worker right after the end
+     * of the previous one, every chunk is tagged by its frame (see scan_chunk::frame()), and
+     * reported parameters are of the first frame but with last_frame set. In interleaving mode
+     * the planes are turned into one SANE_FRAME_RGB frame: the first two are kept in memory and
+     * RGB rows are emitted as soon as rows of the last plane arrive. Depths 1, 8 and 16 are
+     * interleaved, frames of other depths are given as in all-frames mode.
+     */
+    struct frames_policy {
+        bool m_all_frames = false;  ///< acquire all frames of an image by one scanning operation
+        bool m_interleave = false;  ///< (only with m_all_frames) give interleaved RGB data
+    };
+
     struct option_iterator final {
         using value_type = std::pair<int, const ::SANE_Option_Descriptor*>;
 
@@ -203,18 +369,178 @@ public:
         swap(m_name, r.m_name);
         swap(m_lib_internal, r.m_lib_internal);
         swap(m_deletion_cb, r.m_deletion_cb);
+        swap(m_option_descriptors, r.m_option_descriptors);
+        swap(m_option_names, r.m_option_names);
+        swap(m_option_descriptors_valid, r.m_option_descriptors_valid);
+        swap(m_option_layout_generation, r.m_option_layout_generation);
+        swap(m_option_index, r.m_option_index);
+        swap(m_well_known_options, r.m_well_known_options);
+        swap(m_option_word_lists, r.m_option_word_lists);
+        swap(m_sorted_word_lists, r.m_sorted_word_lists);
+        swap(m_option_values, r.m_option_values);
+        swap(m_option_arena, r.m_option_arena);
+        swap(m_option_values_valid, r.m_option_values_valid);
+        swap(m_options_generation, r.m_options_generation);
+        swap(m_read_size_policy, r.m_read_size_policy);
+        swap(m_notify_policy, r.m_notify_policy);
+        swap(m_memory_policy, r.m_memory_policy);
+        swap(m_frames_policy, r.m_frames_policy);
+        swap(m_io_wait_timeout, r.m_io_wait_timeout);
     }
 
     const std::string& name() const { return m_name; }
 
     /**
      * @return a range with option descriptors for every available option of a scanner (even
-     *   inactive or un-editable)
+     *   inactive or un-editable). Descriptors are copied from the C library once into a flat table
+     *   and taken from it until set_option() reports reload_opts, so iterating is just a memory
+     *   access. Pointers to descriptors are invalidated by such a reload.
      */
     std::ranges::subrange<option_iterator> get_option_infos() const;
+
+    /**
+     * Values of all active options are read from the C library together with descriptors and
+     * served from memory afterwards. The returned value points into a slot of this particular
+     * option, so values of a few options can be held at once. It stays valid until options are
+     * reloaded with another layout, and reflects the current value when this option changes.
+     * It can be modified in place only for passing it to set_option() right away. If setting
+     * fails, the value is read back from the C library.
+     */
     opt_value_t get_option(int pos) const;
+
+    /**
+     * Only the option being set is re-read from the C library after setting it, or all options if
+     * the library reports reload_opts.
+     *
+     * The value is checked against the cached constraint before it's sent, so a device gets only
+     * legal values: numbers are clamped and quantized to a range or snapped to the nearest word
+     * of a list, a string is matched to a list ignoring case. An adjusted value is written back
+     * to the passed buffer and value_inexact is reported. A string missing in its list, an
+     * inactive or a read-only option throw without calling the C library.
+     */
     set_opt_result_t set_option(int pos, opt_value_t val);
 
+    /**
+     * Find an option by its name. A hash index of names is built together with the descriptor
+     * table and rebuilt only when options are reloaded.
+     *
+     * @returns index of the option to pass to get_option()/set_option()
+     */
+    std::optional<int> find_option(std::string_view name) const;
+    std::optional<int> find_option(well_known_option opt) const;
+
+    /**
+     * Check once that the option can be accessed as T (bool, ::SANE_Word, fixed,
+     * std::span<const ::SANE_Word> or std::string_view), throws otherwise. Reading through
+     * the returned handle is just a load from the value snapshot.
+     */
+    template <typename T>
+    typed_option<T> get_typed_option(int pos) const {
+        const auto* descr = get_option_info(pos);
+        if (! details::option_value_traits<T>::fits(*descr))
+            throw_option_type_mismatch(pos);
+        return {pos, m_option_layout_generation, descr->name ? descr->name : ""};
+    }
+
+    template <typename T, typename Key>
+        requires std::is_convertible_v<Key, std::string_view> || std::is_same_v<Key, well_known_option>
+    typed_option<T> get_typed_option(const Key& key) const {
+        const auto pos = find_option(key);
+        if (! pos)
+            throw_option_type_mismatch(0);
+        return get_typed_option<T>(*pos);
+    }
+
+    /**
+     * Views (spans and strings) are valid till the next change of options. If options have been
+     * reloaded since the handle was got, the option is found again by its name and checked, it
+     * throws if the option has gone or has got another type.
+     */
+    template <typename T>
+    T get(const typed_option<T>& opt) const {
+        // The handle has been checked against this very layout, so its slot exists
+        if (opt.m_layout_generation == m_option_layout_generation && m_option_values_valid)
+            if (const auto& slot = m_option_values[static_cast<std::size_t>(opt.m_pos) - 1];
+                    slot.m_loaded)
+                return details::option_value_traits<T>::load(option_bytes(slot), slot.m_size);
+
+        const auto& slot = loaded_option_value(current_option_pos(opt));
+        return details::option_value_traits<T>::load(option_bytes(slot), slot.m_size);
+    }
+
+    template <typename T>
+    T get(int pos) const {
+        if (! details::option_value_traits<T>::fits(*get_option_info(pos)))
+            throw_option_type_mismatch(pos);
+        const auto& slot = loaded_option_value(pos);
+        return details::option_value_traits<T>::load(option_bytes(slot), slot.m_size);
+    }
+
+    template <details::settable_option_value T>
+    set_opt_result_t set(const typed_option<T>& opt, T val) {
+        ::SANE_Word storage;
+        return set_option(current_option_pos(opt),
+            details::option_value_traits<T>::to_value(val, storage));
+    }
+
+    using option_setting_t = std::pair<std::string_view, opt_value_t>;
+
+    struct batch_set_result {
+        set_opt_result_t m_flags;       ///< flags reported for all options together
+        std::vector<int> m_inexact;     ///< options whose values have been adjusted by a device
+        std::vector<int> m_changed;     ///< all options changed, including side effects
+        std::uint64_t m_generation = 0; ///< get_options_generation() after the batch
+    };
+
+    /**
+     * Set a few options by their names at once. All names, types and sizes of values are checked
+     * before the first option is set. Whether an option can be set and its constraint are checked
+     * in its turn, so an option activated by another one from the same batch can be set, values
+     * are adjusted like by set_option(). Options are applied in the order of known dependencies
+     * between them - source, mode, depth, resolution, geometry and then all others in the given
+     * order. If a device reports reload_opts in the middle, descriptors are reloaded and the rest
+     * of options are found again by names and checked against them. Values are reloaded only once
+     * at the end, the resulting values are available by get_option() without any device calls.
+     * If setting of some option fails, the exception is propagated, options set before it stay
+     * set.
+     */
+    batch_set_result set_options(std::span<option_setting_t> values);
+
+    /**
+     * @returns a counter incremented every time any known option value changes, either by
+     *    set_option() or as a side effect of it
+     */
+    std::uint64_t get_options_generation() const { return m_options_generation; }
+
+    /**
+     * @returns ascending indices of options whose values have changed after the moment when
+     *    get_options_generation() returned the given generation. If a set of options has been
+     *    changed by a reload, all options are reported.
+     */
+    std::vector<int> changed_options_since(std::uint64_t generation) const;
+
+    /**
+     * Save values of all active software-settable options into a compact binary profile. Options
+     * are keyed by names and types, the profile carries a fingerprint of the set of settable
+     * options, so it can be applied only to a device of the same model (and backend version).
+     * The format is native to the machine, it isn't meant to be moved between architectures.
+     */
+    std::vector<std::byte> save_profile() const;
+
+    /**
+     * Set options which differ from the profile by set_options(), so they go in the dependency
+     * order and options are reloaded once. Options which have been inactive or changed as a side
+     * effect are set by one more pass. Throws if the profile is corrupted or made for another
+     * device model.
+     */
+    batch_set_result apply_profile(std::span<const std::byte> profile);
+
+    /**
+     * Compare the profile with the option value snapshot, no device calls are made once the
+     * snapshot is loaded.
+     */
+    bool profile_matches(std::span<const std::byte> profile) const;
+
     /**
      * Start asynchronous operation for fetching a frame of visual data from a scanner (the process
      * is called "image acquisition" in SANE docs). At start of scanning the device determines
@@ -230,8 +556,57 @@ public:
      *    some messaging queue of a consumer thread wanting to call getters below. If not provided,
      *    synchronous mode is used for getters below - they would block if an internal state hasn't
      *    arived needed point yet.
+     * @returns a future which becomes ready when image parameters are known or holds an error of
+     *    starting (including cancelling before that). The call itself never waits for a device -
+     *    the operation is just queued for a worker thread.
+     */
+    std::future<void> start_scanning(std::function<void()> cb = {});
+
+    /**
+     * The same as start_scanning() above but image data is read by a scanner right into memory
+     * provided by the sink, neither chunks nor the internal queue are involved. The method
+     * get_scanning_data() can't be used for such a scanning operation - the end of the operation
+     * is reported by scan_sink::finished() call. The sink should be alive until that moment.
+     *
+     * @param cb is an optional notification callback which is called on state changes only
+     */
+    std::future<void> start_scanning(scan_sink& sink, std::function<void()> cb = {});
+
+    /// Resumes a coroutine suspended by one of awaiters below
+    using executor_t = std::function<void(std::coroutine_handle<>)>;
+
+    class parameters_awaiter;
+    class chunk_awaiter;
+
+    /**
+     * Coroutine flavour of start_scanning(): starts scanning, `co_await` on the result gives
+     * parameters of the image, all data is got then by `co_await next_chunk()` calls. A coroutine
+     * is suspended only if the state needed hasn't been reached yet. A suspended coroutine is
+     * passed to the executor right from the worker thread - it's expected to resume the coroutine
+     * in a consumer's event loop, so one thread can drive any number of devices. Errors are thrown
+     * from `co_await` expressions. Only one coroutine can wait on a device at a time.
+     */
+    parameters_awaiter scan_parameters(executor_t executor);
+
+    /**
+     * @returns an awaiter for the next block of image data, it gives an empty chunk at the end of
+     *    the scanning. Can be used only for scanning started by scan_parameters()
+     */
+    chunk_awaiter next_chunk();
+
+    class scan_view;
+
+    /**
+     * Pull flavour of scanning: a lazy input range over image data of a frame. The scanning (in
+     * synchronous mode) is started by begin() of the range, each element is a span of the next
+     * block of data borrowed from the range - it stays valid until the iterator is advanced.
+     * The range can be iterated only once. If it's destroyed before the end of data, the scanning
+     * is cancelled.
+     *
+     *     for (std::span<const std::byte> block : dev.scan())
+     *         ...
      */
-    void start_scanning(std::function<void()> cb = {});
+    scan_view scan();
 
     /**
      * @returns scanning parameters of current image or nullptr of called too early. In case of
@@ -244,10 +619,21 @@ public:
      * The method can be called only after get_scanning_parameters() returned non-null pointer in
      * asynchronous mode.
      *
-     * @returns next block of image data or empty buffer in case of end-of-stream (which can be
-     *    caused by requested cancelling also)
+     * @returns next block of image data or empty chunk in case of end-of-stream (which can be
+     *    caused by requested cancelling also). The chunk's buffer goes back to the device's pool
+     *    when the chunk is destroyed, so it's better not to keep chunks longer than needed
+     */
+    scan_chunk get_scanning_data();
+
+    /**
+     * Moves all chunks available at the moment into the end of `dest`. Unlike the method above it
+     * doesn't treat an empty queue as a logic error in asynchronous mode, so it's suitable for
+     * spurious or coalesced notifications. In synchronous mode it waits for at least one chunk.
+     *
+     * @returns number of chunks appended. If the last appended chunk is empty, it's the
+     *    end-of-stream
      */
-    std::vector<unsigned char> get_scanning_data();
+    std::size_t get_scanning_data(std::vector<scan_chunk>& dest);
 
     /**
      * Cancels currently running scan operation asynchronously. The operation can be considered
@@ -255,6 +641,50 @@ public:
      */
     void cancel_scanning(cancel_mode c_mode = cancel_mode::safe);
 
+    /**
+     * @returns timings and counters of the current scanning operation or the last finished one.
+     *    Can be called from any thread at any time, collecting is always on and costs just a few
+     *    relaxed atomic stores per read.
+     */
+    scan_metrics get_scanning_metrics() const { return m_metrics.snapshot(); }
+
+    /**
+     * Set a policy of choosing sane_read() block sizes. Takes effect since the next scanning
+     * operation.
+     */
+    void set_read_size_policy(const read_size_policy& val) { m_read_size_policy = val; }
+    const read_size_policy& get_read_size_policy() const { return m_read_size_policy; }
+
+    /**
+     * Set a policy of notifying a consumer about new data. Takes effect since the next scanning
+     * operation.
+     */
+    void set_notify_policy(const notify_policy& val) { m_notify_policy = val; }
+    const notify_policy& get_notify_policy() const { return m_notify_policy; }
+
+    /**
+     * Set a policy of keeping not consumed data in memory. Takes effect since the next scanning
+     * operation.
+     */
+    void set_memory_policy(const memory_policy& val) { m_memory_policy = val; }
+    const memory_policy& get_memory_policy() const { return m_memory_policy; }
+
+    /**
+     * Set a policy of acquiring multi-frame images. Takes effect since the next scanning
+     * operation.
+     */
+    void set_frames_policy(const frames_policy& val) { m_frames_policy = val; }
+    const frames_policy& get_frames_policy() const { return m_frames_policy; }
+
+    /**
+     * Set maximum time to wait for next data from a scanner in asynchronous I/O mode. If nothing
+     * arrives in time, the scanning fails with SANE_STATUS_IO_ERROR - useful for a device which has
+     * been disconnected in the middle of scanning. Zero (default) means to wait infinitely. Takes
+     * effect since the next scanning operation.
+     */
+    void set_io_wait_timeout(std::chrono::milliseconds val) { m_io_wait_timeout = val; }
+    std::chrono::milliseconds get_io_wait_timeout() const { return m_io_wait_timeout; }
+
 private:
 #ifdef SANE_PP_STUB
     using handle_t = std::vector<std::shared_ptr<details::stub_option>>;
@@ -265,51 +695,245 @@ private:
     using deletion_cb_t = std::function<void(const std::string&)>;
 
     enum class scanning_state : char {
-        idle, starting, scanning
+        idle, queued, starting, scanning
     };
 
     static const char* state_to_str(scanning_state val) {
         switch (val) {
         case scanning_state::idle: return "[idle]";
+        case scanning_state::queued: return "[queued]";
         case scanning_state::starting: return "[starting]";
         case scanning_state::scanning: return "[scanning]";
         default: return "[???]";
         }
     }
 
+    // Everything a worker thread needs to run one scanning operation
+    struct scan_request {
+        std::stop_token m_stop_token;
+        std::function<void()> m_notifier;
+        scan_sink* m_sink = nullptr;
+        std::promise<void> m_started;
+    };
+
 #ifdef SANE_PP_STUB
     mutable handle_t m_handle;
     std::size_t m_sample_image_offset;
 #else
     handle_t m_handle = {};
-    // SANE library requires a storage to place an option data into
-    mutable std::vector<char> m_option_data_buffer;
 #endif
 
     std::string m_name;
     lib::lib_internal* m_lib_internal;
     deletion_cb_t m_deletion_cb; // locks the library singleton inside a lambda, stored here
 
+    // Descriptors of options 1..N, an option index is its position here + 1
+    mutable std::vector<::SANE_Option_Descriptor> m_option_descriptors;
+    // Copies of option names one after another, names of descriptors point here
+    mutable std::vector<char> m_option_names;
+    mutable bool m_option_descriptors_valid = false;
+    mutable std::uint64_t m_option_layout_generation = 0;   ///< incremented on every load
+    // Names point into m_option_names, 0 is for an absent well-known option
+    mutable std::unordered_map<std::string_view, int> m_option_index;
+    mutable std::array<int, static_cast<std::size_t>(well_known_option::last)> m_well_known_options = {};
+
+    struct word_list_ref {
+        std::size_t m_offset = 0;           ///< in m_sorted_word_lists
+        std::size_t m_size = 0;
+    };
+
+    // Copies of word list constraints sorted for binary search, parallel to m_option_descriptors
+    mutable std::vector<word_list_ref> m_option_word_lists;
+    mutable std::vector<::SANE_Word> m_sorted_word_lists;
+
+    struct option_value_slot {
+        std::size_t m_offset = 0;           ///< in bytes from the beginning of m_option_arena
+        std::size_t m_size = 0;
+        std::uint64_t m_generation = 0;     ///< when the value has been changed last time
+        bool m_loaded = false;              ///< inactive options and buttons aren't read
+    };
+
+    // Parallel to m_option_descriptors
+    mutable std::vector<option_value_slot> m_option_values;
+    // Values of all options one after another, each one is aligned to a word. Sized from
+    // descriptors, so a value stays in place until options are reloaded with another layout
+    mutable std::vector<::SANE_Word> m_option_arena;
+    mutable std::vector<char> m_option_read_buffer;     // a new value is compared with a slot
+    mutable bool m_option_values_valid = false;
+    std::uint64_t m_options_generation = 0;
+
     std::mutex m_scanning_state_mutex;
     scanning_state m_scanning_state = scanning_state::idle;
     std::condition_variable m_internal_state_waiting;
-    std::function<void()> m_scanning_state_notifier;
+    std::function<void()> m_scanning_state_notifier; // owned by the worker thread
+    std::stop_source m_scanning_stop_source;
+    bool m_use_scan_sink = false;
     bool m_use_internal_waiter;
     bool m_use_asynchronous_mode;
     std::exception_ptr m_last_scanning_error;
     ::SANE_Parameters m_scanning_params;
-    std::list<std::vector<unsigned char>> m_chunks;
-    int m_waiter_pipes[2];
+    details::chunk_queue m_chunks;
+    std::shared_ptr<details::chunk_pool> m_chunk_pool;
+    read_size_policy m_read_size_policy;
+    notify_policy m_notify_policy;
+    memory_policy m_memory_policy;
+    frames_policy m_frames_policy;
+    details::scan_metrics_collector m_metrics;
+    std::chrono::milliseconds m_io_wait_timeout = {};
+    int m_wakeup_fd = -1;
+    std::atomic<std::chrono::steady_clock::rep> m_cancel_requested_at = 0;
+
+    std::atomic<void*> m_awaiting_coroutine = nullptr;
+    std::atomic<bool> m_awaiting_chunk = false;
+
+    // A long-living worker thread started on the first scanning request. It takes requests one by
+    // one from the queue and stays warm between frames and pages
+    std::mutex m_worker_mutex;
+    std::condition_variable_any m_worker_wakeup;
+    std::list<scan_request> m_worker_requests;
+    // The worker still runs a request after reporting its end, see start_scanning_impl()
+    bool m_worker_busy = false;
+    std::condition_variable m_worker_done;
 
     // Should be the last member here to join the thread in exceptional cases before other members
     // go away
-    std::jthread m_scanning_thread;
+    std::jthread m_worker;
 
     device(handle_t dev_handle, std::string name, lib::lib_internal* lib_int, deletion_cb_t deletion_cb);
 
     const ::SANE_Option_Descriptor* get_option_info(int pos) const;
-    void do_scanning(std::stop_token);
+    void load_option_descriptors() const;
+    void load_option_values() const;
+    bool read_option_value(int pos, option_value_slot& slot) const;
+    void refresh_option_values(std::span<const int> positions, bool reload);
+    void refresh_reloaded_option_values(std::span<const ::SANE_Option_Descriptor> old_descriptors);
+    void* option_value_data(int pos, opt_value_t& val) const;
+    void index_word_list(std::size_t i) const;
+    bool constrain_option_value(int pos, void* data) const;
+    const option_value_slot& loaded_option_value(int pos) const;
+    bool points_into_option(int pos, const void* data) const;
+
+    char* option_bytes(const option_value_slot& slot) const {
+        return reinterpret_cast<char*>(m_option_arena.data()) + slot.m_offset;
+    }
+    [[noreturn]] void throw_option_type_mismatch(int pos) const;
+
+    template <typename T>
+    int current_option_pos(const typed_option<T>& opt) const {
+        if (! opt)
+            throw_option_type_mismatch(0);
+        if (opt.m_layout_generation == m_option_layout_generation)
+            return opt.m_pos;
+        return get_typed_option<T>(opt.m_name).m_pos;
+    }
+    std::uint64_t options_fingerprint() const;
+    void backend_get_value(int pos, void* data) const;
+    ::SANE_Int backend_set_value(int pos, void* data);
+    std::future<void> start_scanning_impl(std::function<void()> cb, scan_sink* sink);
+    void worker_loop(std::stop_token stop_token);
+    void do_scanning(scan_request req);
+    void start_frame(::SANE_Parameters& params, ::SANE_Int& sane_fd);
+    void set_scanning_state(scanning_state val);
     void check_for_scanning_error(std::unique_lock<std::mutex>&& lock);
+    bool scanning_parameters_ready();
+    template <typename F>
+    bool suspend_awaiting(std::coroutine_handle<> h, bool chunk, F&& ready);
+};
+
+class device::parameters_awaiter final {
+public:
+    bool await_ready() const { return m_device->scanning_parameters_ready(); }
+    bool await_suspend(std::coroutine_handle<> h);
+    const ::SANE_Parameters& await_resume();
+
+private:
+    friend device;
+
+    device* m_device;
+
+    explicit parameters_awaiter(device* dev) : m_device{dev} {}
+};
+
+class device::chunk_awaiter final {
+public:
+    bool await_ready() const { return ! m_device->m_chunks.empty(); }
+    bool await_suspend(std::coroutine_handle<> h);
+    scan_chunk await_resume() { return m_device->get_scanning_data(); }
+
+private:
+    friend device;
+
+    device* m_device;
+
+    explicit chunk_awaiter(device* dev) : m_device{dev} {}
+};
+
+class device::scan_view final : public std::ranges::view_interface<scan_view> {
+    // Lives on the heap, so iterators stay valid when the view is moved. Cancels the scanning
+    // which hasn't reached its end on destruction
+    struct state final {
+        device* m_device;
+        scan_chunk m_chunk;
+        bool m_started = false;
+        bool m_finished = false;
+
+        explicit state(device* dev) : m_device{dev} {}
+        state(const state&) = delete;
+        state& operator=(const state&) = delete;
+        ~state();
+
+        void fetch();
+    };
+
+public:
+    class iterator final {
+    public:
+        using value_type = std::span<const std::byte>;
+        using difference_type = std::ptrdiff_t;
+        using iterator_concept = std::input_iterator_tag;
+
+        iterator() = default;
+        iterator(iterator&&) = default;
+        iterator& operator=(iterator&&) = default;
+
+        value_type operator*() const { return std::as_bytes(std::span{m_state->m_chunk}); }
+
+        iterator& operator++() { m_state->fetch(); return *this; }
+        void operator++(int) { ++*this; }
+
+        friend bool operator==(const iterator& it, std::default_sentinel_t) { return it.at_end(); }
+
+    private:
+        friend scan_view;
+
+        state* m_state = nullptr;
+
+        bool at_end() const { return ! m_state || m_state->m_chunk.empty(); }
+
+        explicit iterator(state* s) : m_state{s} {}
+    };
+
+    scan_view() = default;
+    scan_view(scan_view&&) noexcept = default;
+    scan_view& operator=(scan_view&&) noexcept = default;
+
+    void swap(scan_view& r) noexcept { m_state.swap(r.m_state); }
+
+    /// Starts scanning and waits for the first block of data
+    iterator begin();
+    std::default_sentinel_t end() const { return {}; }
+
+    /// Valid after begin() call
+    const ::SANE_Parameters& parameters() const {
+        return *m_state->m_device->get_scanning_parameters();
+    }
+
+private:
+    friend device;
+
+    std::unique_ptr<state> m_state;
+
+    explicit scan_view(device* dev) : m_state{std::make_unique<state>(dev)} {}
 };
 
 inline void swap(device& l, device& r) { l.swap(r); }
@@ -317,6 +941,8 @@ inline void swap(device& l, device& r) { l.swap(r); }
 using device_options_t = std::ranges::subrange<device::option_iterator>;
 
 static_assert(std::bidirectional_iterator<device::option_iterator>);
+static_assert(std::ranges::input_range<device::scan_view>);
+static_assert(std::ranges::view<device::scan_view>);
 static_assert(std::ranges::sized_range<decltype(std::declval<device>().get_option_infos())>);
 
 } // ns vg_sane
@@ -0,0 +1,440 @@
+// vi: textwidth=100
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <string>
+#include <span>
+#include <utility>
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#include <sane/sane.h>
+
+namespace vg_sane {
+
+class device;
+
+namespace details {
+
+class chunk_queue;
+
+/**
+ * Bounded lock-free queue for exactly one producer thread and exactly one consumer thread. The
+ * capacity is rounded up to a power of two. Slots are allocated once, so neither pushing nor
+ * popping touch the heap or take any lock.
+ */
+template <typename T>
+class spsc_ring final {
+public:
+    explicit spsc_ring(std::size_t capacity)
+        : m_mask{std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1}
+        , m_slots{new T[m_mask + 1]} {
+    }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    std::size_t capacity() const { return m_mask + 1; }
+
+    /**
+     * Producer side. The value is moved from only if it has been placed into the queue.
+     *
+     * @param was_empty is set to true if a consumer had taken everything out of the queue before
+     *    this value was placed. Sequentially consistent operations here and in try_pop() guarantee
+     *    that either a consumer sees the new value or a producer sees the queue was empty.
+     */
+    bool try_push(T&& val, bool& was_empty) {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+            return false;
+        m_slots[tail & m_mask] = std::move(val);
+        m_tail.store(tail + 1, std::memory_order_seq_cst);
+        was_empty = m_head.load(std::memory_order_seq_cst) == tail;
+        return true;
+    }
+
+    /// Consumer side
+    bool try_pop(T& val) {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_seq_cst))
+            return false;
+        val = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    /// Consumer side. Blocks until a producer pushes something if the queue is empty
+    void wait_while_empty() const {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        for (auto tail = m_tail.load(std::memory_order_acquire); tail == head;
+                tail = m_tail.load(std::memory_order_acquire))
+            m_tail.wait(tail, std::memory_order_acquire);
+    }
+
+    /**
+     * Producer side. Sequentially consistent like try_pop(), so a producer which has just published
+     * something elsewhere either sees all values taken or a consumer sees that publication.
+     */
+    bool drained() const {
+        return m_head.load(std::memory_order_seq_cst) == m_tail.load(std::memory_order_relaxed);
+    }
+
+    /// Producer side. Wakes a consumer blocked in wait_while_empty(), cheap if nobody waits
+    void notify_consumer() {
+        m_tail.notify_all();
+    }
+
+    bool empty() const {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+private:
+    const std::size_t m_mask;
+    std::unique_ptr<T[]> m_slots;
+    alignas(64) std::atomic<std::size_t> m_head = 0;
+    alignas(64) std::atomic<std::size_t> m_tail = 0;
+};
+
+/**
+ * Bounded lock-free queue for any number of producer and consumer threads (the well-known design
+ * by Dmitry Vyukov with a sequence number per slot). The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class mpmc_ring final {
+public:
+    explicit mpmc_ring(std::size_t capacity)
+        : m_mask{std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1}
+        , m_cells{new cell[m_mask + 1]} {
+        for (std::size_t i = 0; i <= m_mask; ++i)
+            m_cells[i].m_seq.store(i, std::memory_order_relaxed);
+    }
+
+    mpmc_ring(const mpmc_ring&) = delete;
+    mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+    /// The value is moved from only if it has been placed into the queue
+    bool try_push(T&& val) {
+        auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = m_cells[pos & m_mask];
+            const auto diff = static_cast<std::intptr_t>(c.m_seq.load(std::memory_order_acquire))
+                - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.m_value = std::move(val);
+                    c.m_seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0)
+                return false;
+            else
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T& val) {
+        auto pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = m_cells[pos & m_mask];
+            const auto diff = static_cast<std::intptr_t>(c.m_seq.load(std::memory_order_acquire))
+                - static_cast<std::intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    val = std::move(c.m_value);
+                    c.m_seq.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0)
+                return false;
+            else
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct cell {
+        std::atomic<std::size_t> m_seq;
+        T m_value;
+    };
+
+    const std::size_t m_mask;
+    std::unique_ptr<cell[]> m_cells;
+    alignas(64) std::atomic<std::size_t> m_enqueue_pos = 0;
+    alignas(64) std::atomic<std::size_t> m_dequeue_pos = 0;
+};
+
+/**
+ * Raw storage for one block of scanned data. Unlike std::vector it doesn't zero-fill memory on
+ * allocation - a scanner overwrites it anyway.
+ */
+struct chunk_buffer {
+    std::unique_ptr<unsigned char[]> m_data;
+    std::size_t m_capacity = 0;
+    std::size_t m_size = 0;
+};
+
+/**
+ * Keeps buffers released by a consumer for reusing them in next reads from a scanner. Once a scan
+ * has warmed the pool up, the reading cycle doesn't touch the heap at all. Only a limited number of
+ * free buffers is kept to not hold memory of a burst forever. A chunk can be released from any
+ * thread, so free buffers are kept in a lock-free multi-producer queue.
+ */
+class chunk_pool final {
+public:
+    static constexpr std::size_t s_max_free_buffers = 64;
+
+    chunk_buffer acquire(std::size_t capacity) {
+        chunk_buffer res;
+        m_free.try_pop(res);
+
+        if (res.m_capacity < capacity) {
+            res.m_data.reset(new unsigned char[capacity]);
+            res.m_capacity = capacity;
+        }
+        res.m_size = 0;
+        return res;
+    }
+
+    void release(chunk_buffer&& buf) {
+        // The buffer is just freed if the pool is full
+        m_free.try_push(std::move(buf));
+    }
+
+private:
+    mpmc_ring<chunk_buffer> m_free{s_max_free_buffers};
+};
+
+} // ns details
+
+/**
+ * A block of scanned data returned by device::get_scanning_data(). The object owns a buffer
+ * borrowed from a device's pool and returns it back on destruction, so a consumer should just drop
+ * the chunk when it's processed. The chunk can outlive the device it came from.
+ */
+class scan_chunk final {
+public:
+    scan_chunk() = default;
+    scan_chunk(scan_chunk&&) noexcept = default;
+
+    scan_chunk& operator=(scan_chunk&& r) noexcept {
+        auto t = std::move(r);
+        swap(t);
+        return *this;
+    }
+
+    ~scan_chunk() {
+        if (m_pool && m_buf.m_data)
+            m_pool->release(std::move(m_buf));
+    }
+
+    void swap(scan_chunk& r) noexcept {
+        using std::swap;
+        swap(m_buf, r.m_buf);
+        swap(m_pool, r.m_pool);
+        swap(m_frame, r.m_frame);
+    }
+
+    /// A frame of a multi-pass image the data belongs to, see device::frames_policy
+    ::SANE_Frame frame() const { return m_frame; }
+
+    const unsigned char* data() const { return m_buf.m_data.get(); }
+    std::size_t size() const { return m_buf.m_size; }
+    bool empty() const { return m_buf.m_size == 0; }
+
+    const unsigned char* begin() const { return data(); }
+    const unsigned char* end() const { return data() + size(); }
+
+    operator std::span<const unsigned char>() const { return {data(), size()}; }
+
+private:
+    friend device;
+    friend details::chunk_queue;
+
+    details::chunk_buffer m_buf;
+    std::shared_ptr<details::chunk_pool> m_pool;
+    ::SANE_Frame m_frame = SANE_FRAME_GRAY;
+
+    scan_chunk(std::shared_ptr<details::chunk_pool> pool, std::size_t capacity)
+        : m_buf{pool->acquire(capacity)}
+        , m_pool{std::move(pool)} {
+    }
+
+    unsigned char* writable_data() { return m_buf.m_data.get(); }
+    std::size_t capacity() const { return m_buf.m_capacity; }
+    void resize(std::size_t size) { m_buf.m_size = size; }
+    void set_frame(::SANE_Frame frame) { m_frame = frame; }
+};
+
+inline void swap(scan_chunk& l, scan_chunk& r) noexcept { l.swap(r); }
+
+namespace details {
+
+/**
+ * Hands chunks over from a scanning thread (the only producer) to a consumer (the only consumer).
+ * Chunks normally go through a lock-free ring. If a consumer lags so much that the ring is full,
+ * chunks are appended to an overflow list guarded by its own mutex. Once anything is there, all
+ * next chunks go to the list too until a consumer drains it - that keeps the order of chunks. A
+ * scanner can't be paused, so a producer never waits for a free space.
+ *
+ * If a memory budget is set, chunks which don't fit into it are written into an unlinked spill
+ * file and only their positions go to the overflow list. A consumer reads them back in order. Only
+ * chunks still in the queue are accounted, not the ones taken by a consumer.
+ */
+class chunk_queue final {
+public:
+    static constexpr std::size_t s_ring_capacity = 256;
+
+    chunk_queue() = default;
+    chunk_queue(const chunk_queue&) = delete;
+    chunk_queue& operator=(const chunk_queue&) = delete;
+    ~chunk_queue();
+
+    /**
+     * Should be called only when neither a producer nor a consumer work with the queue.
+     *
+     * @param memory_budget maximum number of bytes kept in memory, 0 - unlimited
+     * @param spill_directory a directory for an unlinked spill file, if empty - an anonymous
+     *    memory file (memfd) is used
+     * @param pool a pool to take buffers from for chunks read back from the spill file
+     */
+    void configure(std::size_t memory_budget, std::string spill_directory,
+        std::shared_ptr<chunk_pool> pool) {
+
+        m_memory_budget = memory_budget;
+        m_spill_directory = std::move(spill_directory);
+        m_pool = std::move(pool);
+    }
+
+    /**
+     * Producer side.
+     *
+     * @returns true if the queue was empty before the push, i.e. a consumer has taken everything
+     *    pushed before. It's reported the same way whether the chunk goes to the ring, to the
+     *    overflow list or into the spill file
+     */
+    bool push(scan_chunk&& chunk) {
+        bool was_empty = false;
+        const auto bytes = chunk.capacity();
+
+        if (m_memory_budget != 0 && ! chunk.empty()
+            && m_bytes_in_memory.load(std::memory_order_relaxed) + bytes > m_memory_budget) {
+
+            overflow_entry entry{{}, m_spill_offset, chunk.size(), chunk.frame()};
+            spill(chunk);
+            chunk = {};
+            was_empty = push_overflow(std::move(entry));
+        } else {
+            // Accounted before the push because a consumer can take the chunk out immediately
+            m_bytes_in_memory.fetch_add(bytes, std::memory_order_relaxed);
+
+            if (m_overflow_size.load(std::memory_order_acquire) != 0
+                || ! m_ring.try_push(std::move(chunk), was_empty))
+                was_empty = push_overflow({std::move(chunk), 0, 0});
+        }
+        // The ring itself can't be waited on: a spilled chunk may go to the overflow list while the
+        // ring is empty
+        m_push_count.fetch_add(1, std::memory_order_release);
+        m_push_count.notify_all();
+        return was_empty;
+    }
+
+    /// Consumer side
+    bool try_pop(scan_chunk& chunk) {
+        if (m_ring.try_pop(chunk)) {
+            m_bytes_in_memory.fetch_sub(chunk.capacity(), std::memory_order_relaxed);
+            return true;
+        }
+        // Pairs with push_overflow(): either the new entry is seen here or the producer sees the
+        // ring drained
+        if (m_overflow_size.load(std::memory_order_seq_cst) == 0)
+            return false;
+        // The ring could be seen empty before chunks pushed prior to the overflow became visible
+        if (m_ring.try_pop(chunk)) {
+            m_bytes_in_memory.fetch_sub(chunk.capacity(), std::memory_order_relaxed);
+            return true;
+        }
+
+        overflow_entry entry;
+        {
+            std::lock_guard guard{m_overflow_mutex};
+            entry = std::move(m_overflow.front());
+            m_overflow.pop_front();
+            m_overflow_size.fetch_sub(1, std::memory_order_release);
+        }
+
+        // Reading from the file is done out of the lock to not stall a producer
+        if (entry.m_spilled_size != 0)
+            chunk = read_spilled(entry);
+        else {
+            chunk = std::move(entry.m_chunk);
+            m_bytes_in_memory.fetch_sub(chunk.capacity(), std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    /// Consumer side
+    bool empty() const {
+        return m_ring.empty() && m_overflow_size.load(std::memory_order_acquire) == 0;
+    }
+
+    /// Consumer side
+    void wait_while_empty() const {
+        while (true) {
+            const auto seen = m_push_count.load(std::memory_order_acquire);
+            if (! m_ring.empty() || m_overflow_size.load(std::memory_order_acquire) != 0)
+                return;
+            m_push_count.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    /// Producer side. Number of bytes written into the spill file since the last clear() call
+    std::uint64_t spilled_bytes() const { return m_spill_offset; }
+
+    /// Should be called only when neither a producer nor a consumer work with the queue
+    void clear();
+
+private:
+    // A spilled chunk has an empty m_chunk and non-zero m_spilled_size
+    struct overflow_entry {
+        scan_chunk m_chunk;
+        std::uint64_t m_offset = 0;
+        std::size_t m_spilled_size = 0;
+        ::SANE_Frame m_frame = SANE_FRAME_GRAY;
+    };
+
+    spsc_ring<scan_chunk> m_ring{s_ring_capacity};
+    std::mutex m_overflow_mutex;
+    std::list<overflow_entry> m_overflow;
+    std::atomic<std::size_t> m_overflow_size = 0;
+    std::atomic<std::uint32_t> m_push_count = 0;
+
+    std::size_t m_memory_budget = 0;
+    std::string m_spill_directory;
+    std::shared_ptr<chunk_pool> m_pool;
+    std::atomic<std::size_t> m_bytes_in_memory = 0;
+    int m_spill_fd = -1;                // opened by a producer on the first spill
+    std::uint64_t m_spill_offset = 0;   // owned by a producer
+
+    // A consumer checks the ring before the list, so it has taken everything if both the list was
+    // empty and the ring is seen drained after the entry has become visible
+    bool push_overflow(overflow_entry&& entry) {
+        std::size_t prev;
+        {
+            std::lock_guard guard{m_overflow_mutex};
+            m_overflow.push_back(std::move(entry));
+            prev = m_overflow_size.fetch_add(1, std::memory_order_seq_cst);
+        }
+        return prev == 0 && m_ring.drained();
+    }
+
+    void spill(const scan_chunk& chunk);
+    scan_chunk read_spilled(const overflow_entry& entry);
+};
+
+} // ns details
+} // ns vg_sane
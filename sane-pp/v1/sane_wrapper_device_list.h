@@ -0,0 +1,170 @@
+// vi: textwidth=100
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sane/sane.h>
+
+namespace vg_sane {
+
+/**
+ * Info about one device from a device_list. The strings point into the list and are valid as
+ * long as the list is alive. Every string is also null-terminated, so data() can be passed to
+ * C functions.
+ */
+struct device_info {
+    std::string_view m_name;
+    std::string_view m_vendor;
+    std::string_view m_model;
+    std::string_view m_type;
+};
+
+/**
+ * Difference between two device lists, see device_list::diff(). Applying removals in descending
+ * order and then additions in ascending order turns a sequence of the old list into the new one.
+ */
+struct device_list_diff {
+    std::vector<std::uint32_t> m_removed;   ///< indices in the old list, ascending
+    std::vector<std::uint32_t> m_added;     ///< indices in the new list, ascending
+    /// The same name but other attributes differ: pairs of indices in the old and the new list
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> m_changed;
+
+    bool empty() const { return m_removed.empty() && m_added.empty() && m_changed.empty(); }
+};
+
+/**
+ * Immutable owned snapshot of devices known to the library. All strings are stored in a single
+ * contiguous arena, vendors and types (repeating a lot between devices of one backend) are stored
+ * only once. Devices are sorted by name, so a device has the same index in any list containing
+ * the same set of devices, and two lists are compared by a single merge pass.
+ */
+class device_list final {
+public:
+    using index_t = std::uint32_t;
+
+    device_list() = default;
+
+    /**
+     * Copy devices from a null-terminated array owned by the C library
+     */
+    device_list(const ::SANE_Device* const* devices,
+                std::chrono::steady_clock::time_point enumerated_at)
+        : m_enumerated_at{enumerated_at} {
+        const auto str = [](const char* s) { return s ? std::string_view{s} : std::string_view{}; };
+
+        std::vector<const ::SANE_Device*> sorted;
+        std::size_t arena_size = 0;
+        for (auto p = devices; *p; ++p) {
+            sorted.push_back(*p);
+            for (const char* s : {(*p)->name, (*p)->vendor, (*p)->model, (*p)->type})
+                arena_size += str(s).size() + 1;
+        }
+        std::ranges::sort(sorted, {}, [&str](const ::SANE_Device* d) { return str(d->name); });
+
+        // Reserved beforehand, so the arena is never reallocated while it's filled
+        m_arena.reserve(arena_size);
+        m_records.reserve(sorted.size());
+
+        std::unordered_map<std::string_view, index_t> interned;
+        const auto intern = [&](std::string_view s) {
+            auto [it, inserted] = interned.try_emplace(s, static_cast<index_t>(m_interned.size()));
+            if (inserted)
+                m_interned.push_back(store(s));
+            return it->second;
+        };
+
+        for (const auto* d : sorted)
+            m_records.push_back({store(str(d->name)), store(str(d->model)), intern(str(d->vendor)),
+                intern(str(d->type))});
+    }
+
+    std::size_t size() const { return m_records.size(); }
+    bool empty() const { return m_records.empty(); }
+
+    device_info operator[](std::size_t index) const {
+        const auto& r = m_records[index];
+        return {view(r.m_name), view(m_interned[r.m_vendor]), view(r.m_model),
+            view(m_interned[r.m_type])};
+    }
+
+    auto devices() const {
+        return std::views::iota(std::size_t{0}, size())
+            | std::views::transform([this](std::size_t i) { return (*this)[i]; });
+    }
+
+    /// Binary search by a device name
+    std::optional<index_t> find(std::string_view name) const {
+        auto it = std::ranges::lower_bound(m_records, name, {},
+            [this](const record& r) { return view(r.m_name); });
+        if (it == m_records.end() || view(it->m_name) != name)
+            return {};
+        return static_cast<index_t>(it - m_records.begin());
+    }
+
+    /// Default-constructed if devices have never been enumerated yet
+    std::chrono::steady_clock::time_point enumerated_at() const { return m_enumerated_at; }
+
+    /// Number of distinct vendor and type strings stored
+    std::size_t interned_count() const { return m_interned.size(); }
+
+    static device_list_diff diff(const device_list& from, const device_list& to) {
+        device_list_diff res;
+        index_t i = 0, j = 0;
+
+        while (i < from.size() || j < to.size()) {
+            const auto cmp = i == from.size() ? 1 : j == to.size() ? -1
+                : from.view(from.m_records[i].m_name).compare(to.view(to.m_records[j].m_name));
+            if (cmp < 0)
+                res.m_removed.push_back(i++);
+            else if (cmp > 0)
+                res.m_added.push_back(j++);
+            else {
+                const auto l = from[i], r = to[j];
+                if (l.m_vendor != r.m_vendor || l.m_model != r.m_model || l.m_type != r.m_type)
+                    res.m_changed.emplace_back(i, j);
+                ++i;
+                ++j;
+            }
+        }
+        return res;
+    }
+
+private:
+    struct str_ref {
+        index_t m_offset;
+        index_t m_size;
+    };
+
+    struct record {
+        str_ref m_name;
+        str_ref m_model;
+        index_t m_vendor;   ///< index in m_interned
+        index_t m_type;     ///< index in m_interned
+    };
+
+    std::string m_arena;
+    std::vector<str_ref> m_interned;
+    std::vector<record> m_records;
+    std::chrono::steady_clock::time_point m_enumerated_at;
+
+    str_ref store(std::string_view s) {
+        str_ref res{static_cast<index_t>(m_arena.size()), static_cast<index_t>(s.size())};
+        m_arena.append(s);
+        m_arena.push_back('\0');
+        return res;
+    }
+
+    std::string_view view(str_ref s) const { return {m_arena.data() + s.m_offset, s.m_size}; }
+};
+
+} // ns vg_sane
@@ -0,0 +1,189 @@
+// vi: textwidth=100
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace vg_sane {
+
+/**
+ * Snapshot of timings and counters of the current (or the last finished) scanning operation, see
+ * device::get_scanning_metrics(). All durations are measured since the moment the scanning has
+ * been started on a worker thread, zero means the event hasn't happened yet.
+ */
+struct scan_metrics {
+    /// Bucket 0 counts zero durations, bucket N > 0 - durations in [2^(N-1), 2^N) microseconds,
+    /// the last bucket takes everything longer
+    static constexpr std::size_t s_histogram_buckets = 32;
+    using histogram_t = std::array<std::uint64_t, s_histogram_buckets>;
+
+    std::chrono::microseconds m_time_to_parameters = {};
+    std::chrono::microseconds m_time_to_first_byte = {};
+    std::chrono::microseconds m_elapsed = {};   ///< till now or till the end of the scanning
+    bool m_finished = false;
+
+    std::uint64_t m_bytes = 0;
+    double m_bytes_per_second = 0;              ///< since the first byte
+    std::uint64_t m_reads = 0;
+    std::uint64_t m_zero_byte_reads = 0;
+    std::size_t m_peak_queue_depth = 0;         ///< in chunks, 0 for a scan sink
+
+    histogram_t m_read_latency = {};            ///< sane_read() including waiting for data
+    histogram_t m_notify_to_consume_latency = {};   ///< notification -> get_scanning_data()
+};
+
+namespace details {
+
+/**
+ * Collects scan_metrics with almost no overhead. Every counter has exactly one writer - either a
+ * scanning thread or a consumer, so they are updated by relaxed load-store pairs without any
+ * read-modify-write operations. Counters of different writers live on different cache lines.
+ * A snapshot can be taken from any thread at any time, it's not guaranteed to be consistent
+ * between fields while scanning is in progress.
+ */
+class scan_metrics_collector final {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    /// Should be called only when nobody else works with the object
+    void reset() {
+        for (auto* p : {&m_started_at, &m_params_at, &m_first_byte_at, &m_finished_at,
+                &m_last_notify_at, &m_consumed_notify_at})
+            p->store(0, std::memory_order_relaxed);
+        for (auto* p : {&m_bytes, &m_reads, &m_zero_byte_reads, &m_pushed, &m_peak_depth, &m_popped})
+            p->store(0, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < scan_metrics::s_histogram_buckets; ++i) {
+            m_read_latency[i].store(0, std::memory_order_relaxed);
+            m_notify_latency[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    static clock_t::rep now() { return clock_t::now().time_since_epoch().count(); }
+
+    // Scanning thread side
+
+    void started() { m_started_at.store(now(), std::memory_order_relaxed); }
+    void parameters_got() { m_params_at.store(now(), std::memory_order_relaxed); }
+    void finished() { m_finished_at.store(now(), std::memory_order_relaxed); }
+
+    void read_done(clock_t::rep read_started_at, std::size_t bytes) {
+        const auto t = now();
+        bump(m_read_latency[bucket(t - read_started_at)]);
+        bump(m_reads);
+        if (bytes == 0)
+            bump(m_zero_byte_reads);
+        else {
+            if (m_first_byte_at.load(std::memory_order_relaxed) == 0)
+                m_first_byte_at.store(t, std::memory_order_relaxed);
+            m_bytes.store(m_bytes.load(std::memory_order_relaxed) + bytes,
+                std::memory_order_relaxed);
+        }
+    }
+
+    void chunk_pushed() {
+        const auto pushed = m_pushed.load(std::memory_order_relaxed) + 1;
+        m_pushed.store(pushed, std::memory_order_relaxed);
+        const auto depth = pushed - m_popped.load(std::memory_order_relaxed);
+        if (depth > m_peak_depth.load(std::memory_order_relaxed))
+            m_peak_depth.store(depth, std::memory_order_relaxed);
+    }
+
+    void consumer_notified() { m_last_notify_at.store(now(), std::memory_order_relaxed); }
+
+    // Consumer side
+
+    void chunks_popped(std::size_t count) {
+        if (count == 0)
+            return;
+        m_popped.store(m_popped.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+
+        // Only the first consumption after a notification is accounted
+        const auto notify_at = m_last_notify_at.load(std::memory_order_relaxed);
+        if (notify_at != 0 && notify_at != m_consumed_notify_at.load(std::memory_order_relaxed)) {
+            m_consumed_notify_at.store(notify_at, std::memory_order_relaxed);
+            bump(m_notify_latency[bucket(now() - notify_at)]);
+        }
+    }
+
+    // Any thread
+
+    scan_metrics snapshot() const {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+
+        const auto to_us = [](clock_t::rep d) {
+            return duration_cast<microseconds>(clock_t::duration{d}); };
+        const auto since_start = [&](const std::atomic<clock_t::rep>& at, clock_t::rep started) {
+            const auto t = at.load(std::memory_order_relaxed);
+            return t != 0 ? to_us(t - started) : microseconds{}; };
+
+        scan_metrics res;
+        const auto started = m_started_at.load(std::memory_order_relaxed);
+        if (started == 0)
+            return res;
+
+        const auto finished = m_finished_at.load(std::memory_order_relaxed);
+        const auto end = finished != 0 ? finished : now();
+        const auto first_byte = m_first_byte_at.load(std::memory_order_relaxed);
+
+        res.m_time_to_parameters = since_start(m_params_at, started);
+        res.m_time_to_first_byte = since_start(m_first_byte_at, started);
+        res.m_elapsed = to_us(end - started);
+        res.m_finished = finished != 0;
+        res.m_bytes = m_bytes.load(std::memory_order_relaxed);
+        res.m_reads = m_reads.load(std::memory_order_relaxed);
+        res.m_zero_byte_reads = m_zero_byte_reads.load(std::memory_order_relaxed);
+        res.m_peak_queue_depth = m_peak_depth.load(std::memory_order_relaxed);
+
+        if (first_byte != 0 && end > first_byte)
+            res.m_bytes_per_second = static_cast<double>(res.m_bytes)
+                / std::chrono::duration<double>(clock_t::duration{end - first_byte}).count();
+
+        for (std::size_t i = 0; i < scan_metrics::s_histogram_buckets; ++i) {
+            res.m_read_latency[i] = m_read_latency[i].load(std::memory_order_relaxed);
+            res.m_notify_to_consume_latency[i] = m_notify_latency[i].load(std::memory_order_relaxed);
+        }
+        return res;
+    }
+
+private:
+    using counter_t = std::atomic<std::uint64_t>;
+    using histogram_t = std::array<counter_t, scan_metrics::s_histogram_buckets>;
+
+    // Written by a scanning thread
+    alignas(64) std::atomic<clock_t::rep> m_started_at = 0;
+    std::atomic<clock_t::rep> m_params_at = 0;
+    std::atomic<clock_t::rep> m_first_byte_at = 0;
+    std::atomic<clock_t::rep> m_finished_at = 0;
+    std::atomic<clock_t::rep> m_last_notify_at = 0;
+    counter_t m_bytes = 0;
+    counter_t m_reads = 0;
+    counter_t m_zero_byte_reads = 0;
+    counter_t m_pushed = 0;
+    counter_t m_peak_depth = 0;
+    histogram_t m_read_latency = {};
+
+    // Written by a consumer
+    alignas(64) counter_t m_popped = 0;
+    std::atomic<clock_t::rep> m_consumed_notify_at = 0;
+    histogram_t m_notify_latency = {};
+
+    static void bump(counter_t& c) {
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static std::size_t bucket(clock_t::rep d) {
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            clock_t::duration{d}).count();
+        return std::min<std::size_t>(us > 0 ? std::bit_width(static_cast<std::uint64_t>(us)) : 0,
+            scan_metrics::s_histogram_buckets - 1);
+    }
+};
+
+} // ns details
+} // ns vg_sane
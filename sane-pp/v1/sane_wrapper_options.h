@@ -0,0 +1,155 @@
+// vi: textwidth=100
+#pragma once
+
+#include <compare>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include <sane/sane.h>
+
+namespace vg_sane {
+
+class device;
+
+/**
+ * A holder type of various SANE types. Indexed as:
+ *     * [0] (std::monostate) - for SANE_TYPE_BUTTON, SANE_TYPE_GROUP
+ *     * [1] (::SANE_Word&) - for SANE_TYPE_BOOL
+ *     * [2] (std::span<::SANE_Word>) - for SANE_TYPE_INT, SANE_TYPE_FIXED (they could be arrays)
+ *     * [3] (::SANE_String) - for SANE_TYPE_STRING
+ *
+ * Underlying types are exposed here via C++ wrapper public interface for increasing efficiency
+ * because the C library can slighly modify an option value even while a caller wants to set it for
+ * a device. But it's still a design question: whether it's better to fully isolate underlying
+ * library and the way data types are represented?
+ */
+using opt_value_t = std::variant<
+    std::monostate, std::reference_wrapper<::SANE_Word>, std::span<::SANE_Word>, ::SANE_String>;
+
+/**
+ * A value of a single SANE_TYPE_FIXED option
+ */
+struct fixed {
+    ::SANE_Fixed m_value = 0;
+
+    static constexpr fixed from_double(double val) { return {SANE_FIX(val)}; }
+    constexpr double to_double() const { return SANE_UNFIX(m_value); }
+
+    friend constexpr auto operator<=>(const fixed&, const fixed&) = default;
+};
+
+namespace details {
+
+/**
+ * Describes how a C++ type is mapped onto option values. fits() checks a descriptor, load()
+ * reads a value stored in the C library format, to_value() (only for scalars) prepares a value
+ * for setting.
+ */
+template <typename T>
+struct option_value_traits;
+
+inline ::SANE_Word load_word(const char* data) {
+    ::SANE_Word res;
+    std::memcpy(&res, data, sizeof(res));
+    return res;
+}
+
+template <>
+struct option_value_traits<bool> {
+    static bool fits(const ::SANE_Option_Descriptor& d) {
+        return d.type == SANE_TYPE_BOOL && d.size == sizeof(::SANE_Word);
+    }
+    static bool load(const char* data, std::size_t) { return load_word(data) != SANE_FALSE; }
+    static opt_value_t to_value(bool val, ::SANE_Word& storage) {
+        storage = val ? SANE_TRUE : SANE_FALSE;
+        return std::ref(storage);
+    }
+};
+
+template <>
+struct option_value_traits<::SANE_Word> {
+    static bool fits(const ::SANE_Option_Descriptor& d) {
+        return d.type == SANE_TYPE_INT && d.size == sizeof(::SANE_Word);
+    }
+    static ::SANE_Word load(const char* data, std::size_t) { return load_word(data); }
+    static opt_value_t to_value(::SANE_Word val, ::SANE_Word& storage) {
+        storage = val;
+        return std::span{&storage, 1};
+    }
+};
+
+template <>
+struct option_value_traits<fixed> {
+    static bool fits(const ::SANE_Option_Descriptor& d) {
+        return d.type == SANE_TYPE_FIXED && d.size == sizeof(::SANE_Word);
+    }
+    static fixed load(const char* data, std::size_t) { return {load_word(data)}; }
+    static opt_value_t to_value(fixed val, ::SANE_Word& storage) {
+        storage = val.m_value;
+        return std::span{&storage, 1};
+    }
+};
+
+/// Both integer and fixed arrays, valid till options are reloaded with another layout
+template <>
+struct option_value_traits<std::span<const ::SANE_Word>> {
+    static bool fits(const ::SANE_Option_Descriptor& d) {
+        return d.type == SANE_TYPE_INT || d.type == SANE_TYPE_FIXED;
+    }
+    static std::span<const ::SANE_Word> load(const char* data, std::size_t size) {
+        return {reinterpret_cast<const ::SANE_Word*>(data), size / sizeof(::SANE_Word)};
+    }
+};
+
+/// Valid till options are reloaded with another layout
+template <>
+struct option_value_traits<std::string_view> {
+    static bool fits(const ::SANE_Option_Descriptor& d) { return d.type == SANE_TYPE_STRING; }
+    static std::string_view load(const char* data, std::size_t size) {
+        return {data, ::strnlen(data, size)};
+    }
+};
+
+template <typename T>
+concept settable_option_value = requires(T val, ::SANE_Word& storage) {
+    { option_value_traits<T>::to_value(val, storage) } -> std::same_as<opt_value_t>;
+};
+
+} // ns details
+
+/**
+ * A handle of an option checked to be of type T, see device::get_typed_option(). Reading through
+ * it doesn't need any type checks and doesn't throw while options aren't reloaded. After a reload
+ * the option is found again by its name, as its index could be taken by another option.
+ */
+template <typename T>
+class typed_option final {
+public:
+    typed_option() = default;
+
+    int index() const { return m_pos; }
+    const std::string& name() const { return m_name; }
+    explicit operator bool() const { return m_pos != 0; }
+
+private:
+    friend device;
+
+    int m_pos = 0;
+    std::uint64_t m_layout_generation = 0;  ///< generation of descriptors the check was done for
+    std::string m_name;
+
+    typed_option(int pos, std::uint64_t layout_generation, std::string name)
+        : m_pos{pos}
+        , m_layout_generation{layout_generation}
+        , m_name{std::move(name)} {
+    }
+};
+
+} // ns vg_sane
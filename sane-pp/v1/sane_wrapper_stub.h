@@ -6,6 +6,9 @@
 #include <vector>
 #include <initializer_list>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
 
 #include <sane/sane.h>
 
@@ -113,6 +116,14 @@ struct stub_option {
     [[nodiscard]] auto str() const { return str_accessor{*this}; }
 };
 
+// Imitates a slow device. Skipped if SANE_PP_STUB_NO_DELAYS environment variable is set, so tests
+// can run at full speed
+inline void stub_delay(std::chrono::milliseconds duration) {
+    static const bool s_no_delays = std::getenv("SANE_PP_STUB_NO_DELAYS") != nullptr;
+    if (! s_no_delays)
+        std::this_thread::sleep_for(duration);
+}
+
 constexpr unsigned char g_sample_image[] = {
         0b11111111u, 0b11111111u, 0b11111111u, 0b11111111u,     // 1
         0b10000000u, 0b00000000u, 0b00000000u, 0b00000001u,     // 2